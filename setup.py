@@ -34,7 +34,9 @@ extensions = [
         name="zfits." + name,
         sources=[os.path.join("zfits", name + ext)]
         + [os.path.join("zfits", "remove_spikes_source.cpp")],
-        extra_compile_args=["-std=c++0x"],
+        extra_compile_args=["-std=c++0x", "-pthread"],
+        extra_link_args=["-pthread"],
+        libraries=["z"],
         language="c++",
         include_dirs=["zfits"],
     )
@@ -0,0 +1,342 @@
+import gzip
+import shutil
+
+import numpy as np
+import pytest
+
+
+# FITS::CompressionProcess_t
+RAW = 0x0
+SMOOTHING = 0x1
+HUFFMAN16 = 0x2
+HUFFMAN16_CANONICAL = 0x3
+TANS16 = 0x4
+
+
+def write_file(fname, columns, data, max_catalog_rows=1000, rows_per_tile=100):
+    from zfits.factfits import Pyzofits
+
+    f = Pyzofits(fname, max_catalog_rows, rows_per_tile)
+    for name, (processings, ordering) in columns.items():
+        f.AddColumn(name, 'I', data[name].shape[1], processings, ordering)
+    f.WriteTableHeader('Events')
+
+    num_rows = len(data[next(iter(columns))])
+    for row in range(num_rows):
+        f.WriteRow(b''.join(data[name][row].tobytes() for name in columns))
+
+    f.close()
+
+
+def write_plain_file(fname, data, keys=()):
+    # A table which is not compressed
+    def block(cards):
+        text = ''.join(card.ljust(80) for card in cards + ['END'])
+        return text.ljust((len(text) + 2879) // 2880 * 2880).encode('ascii')
+
+    rows = np.hstack([data[name] for name in data]).astype('>i2')
+
+    cards = [
+        "XTENSION= 'BINTABLE'",
+        'BITPIX  = {:>20}'.format(8),
+        'NAXIS   = {:>20}'.format(2),
+        'NAXIS1  = {:>20}'.format(rows.shape[1] * 2),
+        'NAXIS2  = {:>20}'.format(rows.shape[0]),
+        'PCOUNT  = {:>20}'.format(0),
+        'GCOUNT  = {:>20}'.format(1),
+        'TFIELDS = {:>20}'.format(len(data)),
+    ]
+    for i, name in enumerate(data, 1):
+        cards.append("TTYPE{:<3}= '{}'".format(i, name))
+        cards.append("TFORM{:<3}= '{}I'".format(i, data[name].shape[1]))
+    cards.append("EXTNAME = 'Events'")
+    cards.extend(keys)
+
+    body = rows.tobytes()
+    body += bytes(-len(body) % 2880)
+
+    with open(fname, 'wb') as f:
+        f.write(block(['SIMPLE  = {:>20}'.format('T'), 'BITPIX  = {:>20}'.format(8),
+                       'NAXIS   = {:>20}'.format(0), 'EXTEND  = {:>20}'.format('T')]))
+        f.write(block(cards))
+        f.write(body)
+
+
+def read_file(fname):
+    from zfits.factfits import Pyfactfits
+
+    f = Pyfactfits(fname, 'Events')
+    arrays = {
+        name.decode('ascii'): f.SetPtrAddress_int16(name)
+        for name in f.cols_dtypes
+    }
+
+    data = {name: [] for name in arrays}
+    while f.GetNextRow():
+        for name, array in arrays.items():
+            data[name].append(array.copy())
+
+    return f, {name: np.array(rows) for name, rows in data.items()}
+
+
+def erase_catalog(fname):
+    # Zero the catalog of the table, as if its writer had not finished
+    with open(fname, 'r+b') as f:
+        data = f.read()
+
+        start = data.index(b"XTENSION= 'BINTABLE'")
+        cards = {}
+        end = start
+        while not data[end:end + 80].startswith(b'END '):
+            key, _, value = data[end:end + 80].decode('ascii').partition('=')
+            cards[key.strip()] = value.split('/')[0].strip()
+            end += 80
+
+        f.seek(start + (end + 80 - start + 2879) // 2880 * 2880)
+        f.write(bytes(int(cards['NAXIS1']) * int(cards['NAXIS2'])))
+
+
+def make_data(num_rows, num_samples=300):
+    rng = np.random.RandomState(42)
+    t = np.arange(num_samples)
+
+    # Smooth waveforms as in the FACT data, a ramp and random values
+    # which do not compress at all
+    return {
+        'Wave': (500 + 100 * np.sin(0.05 * t + np.arange(num_rows)[:, None])
+                 + rng.randint(-3, 4, (num_rows, num_samples))).astype(np.int16),
+        'Ramp': (3 * np.arange(9) + np.arange(num_rows)[:, None] % 4).astype(np.int16),
+        'Noise': rng.randint(-2**15, 2**15, (num_rows, 4)).astype(np.int16),
+    }
+
+
+@pytest.mark.parametrize('processings', [
+    [RAW],
+    [SMOOTHING, RAW],
+    [HUFFMAN16],
+    [SMOOTHING, HUFFMAN16],
+    [HUFFMAN16_CANONICAL],
+    [SMOOTHING, HUFFMAN16_CANONICAL],
+    [TANS16],
+    [SMOOTHING, TANS16],
+])
+@pytest.mark.parametrize('ordering', ['R', 'C'])
+def test_round_trip(tmpdir, processings, ordering):
+    fname = str(tmpdir.join('test.fits.fz'))
+
+    columns = {name: (processings, ordering) for name in ['Wave', 'Ramp', 'Noise']}
+    data = make_data(250)
+
+    write_file(fname, columns, data)
+    f, read = read_file(fname)
+
+    for name in columns:
+        assert np.array_equal(read[name], data[name])
+
+    assert f.IsFileOk()
+
+
+def test_round_trip_shrunk_catalog(tmpdir):
+    fname = str(tmpdir.join('test.fits.fz'))
+
+    columns = {
+        'Wave': ([SMOOTHING, HUFFMAN16], 'R'),
+        'Ramp': ([HUFFMAN16_CANONICAL], 'C'),
+        'Noise': ([TANS16], 'R'),
+    }
+    data = make_data(1037, num_samples=20)
+
+    # 104 tiles do not fit into a catalog of 18 rows
+    write_file(fname, columns, data, max_catalog_rows=18, rows_per_tile=10)
+    f, read = read_file(fname)
+
+    assert f.GetStr('ZSHRINK') == '6'
+
+    for name in columns:
+        assert np.array_equal(read[name], data[name])
+
+    assert f.IsFileOk()
+
+
+def test_numeric_keys(tmpdir):
+    from zfits.factfits import Pyfactfits
+
+    fname = str(tmpdir.join('test.fits'))
+
+    write_plain_file(fname, make_data(10), [
+        'KINT    = {:>20}'.format(42),
+        'KNEG    = {:>20}'.format(-7),
+        'KEXP    = {:>20}'.format('1E5'),
+        'KFLOAT  = {:>20}'.format('-2.5E-3'),
+        "KQUOTED = '3.75'",
+    ])
+
+    f = Pyfactfits(fname, 'Events')
+    assert f.GetInt('KINT') == 42
+    assert f.GetFloat('KINT') == 42
+    assert f.GetInt('KNEG') == -7
+    assert f.GetFloat('KEXP') == 1e5
+    assert f.GetFloat('KFLOAT') == -2.5e-3
+    assert f.GetInt('KFLOAT') == 0
+    assert f.GetFloat('KQUOTED') == 3.75
+    assert f.GetInt('KQUOTED') == 3
+    assert f.GetStr('KQUOTED') == '3.75'
+
+
+@pytest.mark.parametrize('erased', [False, True])
+def test_recover_catalog(tmpdir, erased):
+    from zfits.factfits import Pyfactfits
+
+    fname = str(tmpdir.join('test.fits.fz'))
+
+    columns = {
+        'Wave': ([SMOOTHING, HUFFMAN16], 'R'),
+        'Ramp': ([HUFFMAN16_CANONICAL], 'C'),
+        'Noise': ([RAW], 'C'),
+    }
+    data = make_data(1037)
+
+    # The recovered catalog has one row per tile, the shrunk one of the
+    # file one per six. The columns of the tiles differ in size.
+    write_file(fname, columns, data, max_catalog_rows=18, rows_per_tile=10)
+    if erased:
+        erase_catalog(fname)
+
+    f = Pyfactfits(fname, 'Events')
+    if erased:
+        assert f.RecoverCatalog() == len(data['Wave'])
+
+    arrays = {
+        name.decode('ascii'): f.SetPtrAddress_int16(name)
+        for name in f.cols_dtypes
+    }
+
+    for row in range(10):
+        assert f.GetNextRow()
+        for name, array in arrays.items():
+            assert np.array_equal(array, data[name][row])
+
+    # Recovering again, after rows were read, starts over at the first row
+    assert f.RecoverCatalog() == len(data['Wave'])
+
+    for row in range(len(data['Wave'])):
+        assert f.GetNextRow()
+        for name, array in arrays.items():
+            assert np.array_equal(array, data[name][row])
+
+    assert not f.GetNextRow()
+
+
+def test_multi_word_string_key(tmpdir):
+    from zfits.factfits import Pyzofits, Pyfactfits
+
+    fname = str(tmpdir.join('test.fits.fz'))
+
+    f = Pyzofits(fname)
+    f.AddColumn('Ramp', 'I', 9)
+    f.SetStr('TELESCOP', 'FACT')
+    f.SetStr('ORIGIN', 'FACT Collaboration, La Palma')
+    f.WriteTableHeader('Events')
+    f.WriteRow(np.arange(9, dtype=np.int16).tobytes())
+    f.close()
+
+    f = Pyfactfits(fname, 'Events')
+    assert f.GetStr('TELESCOP') == 'FACT'
+    assert f.GetStr('ORIGIN') == 'FACT Collaboration, La Palma'
+
+
+def gzip_file(fname):
+    with open(fname, 'rb') as src, gzip.open(fname + '.gz', 'wb') as dest:
+        shutil.copyfileobj(src, dest)
+    return fname + '.gz'
+
+
+def scan_with_fetch(fname, data, read_ahead=0):
+    from zfits.factfits import Pyfactfits
+
+    f = Pyfactfits(fname, 'Events')
+    if read_ahead:
+        f.SetReadAhead(read_ahead)
+
+    wave = f.SetPtrAddress_int16(b'Wave')
+
+    num_rows = len(data['Wave'])
+    for row in range(num_rows // 2):
+        assert f.GetNextRow()
+        assert np.array_equal(wave, data['Wave'][row])
+
+    # Neither the current row nor the checksums may change
+    rows = [num_rows - 1, num_rows - 40, 3, num_rows // 2 + 50]
+    assert np.array_equal(f.FetchRows(rows, b'Wave'), data['Wave'][rows])
+
+    for row in range(num_rows // 2, num_rows):
+        assert f.GetNextRow()
+        assert np.array_equal(wave, data['Wave'][row])
+
+    assert not f.GetNextRow()
+    return f
+
+
+@pytest.mark.parametrize('compressed', [False, True])
+@pytest.mark.parametrize('read_ahead', [0, 2])
+def test_fetch_rows_during_scan(tmpdir, compressed, read_ahead):
+    fname = str(tmpdir.join('test.fits.fz'))
+
+    columns = {
+        'Wave': ([SMOOTHING, HUFFMAN16], 'R'),
+        'Ramp': ([HUFFMAN16], 'C'),
+        'Noise': ([RAW], 'C'),
+    }
+    data = make_data(1037, num_samples=20)
+
+    # The last sub-tile of a shrunk catalog can only be read through the stream
+    write_file(fname, columns, data, max_catalog_rows=18, rows_per_tile=10)
+
+    if compressed:
+        fname = gzip_file(fname)
+
+    f = scan_with_fetch(fname, data, read_ahead)
+    assert f.IsFileOk()
+
+
+@pytest.mark.parametrize('compressed', [False, True])
+def test_fetch_rows_during_scan_uncompressed_table(tmpdir, compressed):
+    fname = str(tmpdir.join('test.fits'))
+
+    # More rows than are read at once during a scan
+    data = make_data(20000)
+
+    write_plain_file(fname, data)
+
+    if compressed:
+        fname = gzip_file(fname)
+
+    # There is no checksum for IsFileOk to verify
+    scan_with_fetch(fname, data)
+
+
+def test_canonical_huffman_single_symbol(tmpdir):
+    fname = str(tmpdir.join('test.fits.fz'))
+
+    # Only one symbol: a code of a single bit
+    columns = {'Const': ([HUFFMAN16_CANONICAL], 'R')}
+    data = {'Const': np.full((50, 1440), -7, dtype=np.int16)}
+
+    write_file(fname, columns, data)
+    f, read = read_file(fname)
+
+    assert np.array_equal(read['Const'], data['Const'])
+    assert f.IsFileOk()
+
+
+def test_tans_single_symbol(tmpdir):
+    fname = str(tmpdir.join('test.fits.fz'))
+
+    columns = {'Const': ([TANS16], 'R')}
+    data = {'Const': np.full((50, 1440), -7, dtype=np.int16)}
+
+    write_file(fname, columns, data)
+    f, read = read_file(fname)
+
+    assert np.array_equal(read['Const'], data['Const'])
+    assert f.IsFileOk()
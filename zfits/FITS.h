@@ -86,9 +86,11 @@ namespace FITS
     //Identifier of the compression schemes processes
     enum CompressionProcess_t
     {
-        kFactRaw       = 0x0,
-        kFactSmoothing = 0x1,
-        kFactHuffman16 = 0x2
+        kFactRaw                = 0x0,
+        kFactSmoothing          = 0x1,
+        kFactHuffman16          = 0x2,
+        kFactHuffman16Canonical = 0x3, ///< canonical Huffman codes of at most 15 bits, only their lengths stored
+        kFactTANS16             = 0x4  ///< table based asymmetric numeral systems, see tans.h
     };
 
     //ordering of the columns / rows
@@ -0,0 +1,436 @@
+/*
+ * asyncread.h
+ *
+ * Many reads from files at given positions in flight at once. On Linux
+ * the reads are submitted to the kernel together through io_uring, so
+ * that the storage sees a deep queue instead of one read after the
+ * other. Where io_uring is not available the reads are done by a pool
+ * of threads with pread.
+ *
+ */
+
+#ifndef MARS_asyncread
+#define MARS_asyncread
+
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "threadpool.h"
+
+class AsyncReader
+{
+public:
+    // A read which has finished
+    struct Result
+    {
+        uint64_t id;     ///< as given to Submit
+        ssize_t  result; ///< number of bytes read or -errno
+    };
+
+private:
+    // A read in flight
+    struct Request
+    {
+        uint64_t id;
+        int      fd;
+        off_t    pos;
+        char    *dest;
+        size_t   size;
+        size_t   done;
+    };
+
+    std::vector<Request> fRequests; ///< requests in flight, the index is the io_uring user data
+    std::vector<size_t>  fFree;     ///< unused entries of fRequests
+    size_t               fPending;  ///< requests submitted and not yet returned by Wait
+
+    // Read the rest of a request on the calling thread
+    static ssize_t ReadBlocking(Request &req)
+    {
+        while (req.done<req.size)
+        {
+            const ssize_t n = pread(req.fd, req.dest+req.done, req.size-req.done, req.pos+req.done);
+            if (n<0 && errno==EINTR)
+                continue;
+            if (n<0)
+                return -errno;
+            if (n==0)
+                break;
+
+            req.done += n;
+        }
+
+        return req.done;
+    }
+
+    // ---------------- thread pool fallback ----------------
+
+    std::mutex              fMutex;
+    std::condition_variable fCond;
+    std::deque<Result>      fCompleted; ///< reads finished by the pool
+
+    ThreadPool fPool; ///< joined first on destruction, as the workers use the members above
+
+    void SubmitToPool(size_t slot)
+    {
+        fPool.Submit([this, slot]()
+        {
+            const Result res = { slot, ReadBlocking(fRequests[slot]) };
+
+            std::lock_guard<std::mutex> lock(fMutex);
+            fCompleted.push_back(res);
+            fCond.notify_one();
+        });
+    }
+
+    Result WaitForPool()
+    {
+        std::unique_lock<std::mutex> lock(fMutex);
+        fCond.wait(lock, [this]() { return !fCompleted.empty(); });
+
+        const Result res = fCompleted.front();
+        fCompleted.pop_front();
+        return res;
+    }
+
+#ifdef HAVE_IO_URING
+    // ---------------- io_uring ----------------
+
+    int fRing; ///< file descriptor of the ring, -1 if not used
+
+    void  *fSqPtr;
+    size_t fSqSize;
+    void  *fCqPtr;
+    size_t fCqSize;
+
+    io_uring_sqe *fSqes;
+    size_t        fSqesSize;
+
+    unsigned *fSqHead;
+    unsigned *fSqTail;
+    unsigned *fSqMask;
+    unsigned *fSqArray;
+    unsigned *fCqHead;
+    unsigned *fCqTail;
+    unsigned *fCqMask;
+
+    io_uring_cqe *fCqes;
+
+    unsigned fToSubmit; ///< entries queued, but not yet passed to the kernel
+
+    bool SetupRing(unsigned entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(io_uring_params));
+
+        fRing = syscall(__NR_io_uring_setup, entries, &params);
+        if (fRing<0)
+            return false;
+
+        fSqSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+        fCqSize = params.cq_off.cqes  + params.cq_entries*sizeof(io_uring_cqe);
+
+        const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            fSqSize = fCqSize = std::max(fSqSize, fCqSize);
+
+        fSqPtr = mmap(NULL, fSqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fRing, IORING_OFF_SQ_RING);
+        fCqPtr = single ? fSqPtr :
+            mmap(NULL, fCqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fRing, IORING_OFF_CQ_RING);
+
+        fSqesSize = params.sq_entries*sizeof(io_uring_sqe);
+        fSqes = reinterpret_cast<io_uring_sqe*>(mmap(NULL, fSqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fRing, IORING_OFF_SQES));
+
+        if (fSqPtr==MAP_FAILED || fCqPtr==MAP_FAILED || fSqes==MAP_FAILED)
+        {
+            CloseRing();
+            return false;
+        }
+
+        char *sq = reinterpret_cast<char*>(fSqPtr);
+        char *cq = reinterpret_cast<char*>(fCqPtr);
+
+        fSqHead  = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        fSqTail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        fSqMask  = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        fSqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        fCqHead  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        fCqTail  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        fCqMask  = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        fCqes    = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        return true;
+    }
+
+    void CloseRing()
+    {
+        if (fSqes && fSqes!=MAP_FAILED)
+            munmap(fSqes, fSqesSize);
+        if (fCqPtr && fCqPtr!=MAP_FAILED && fCqPtr!=fSqPtr)
+            munmap(fCqPtr, fCqSize);
+        if (fSqPtr && fSqPtr!=MAP_FAILED)
+            munmap(fSqPtr, fSqSize);
+        if (fRing>=0)
+            close(fRing);
+
+        fRing  = -1;
+        fSqPtr = fCqPtr = NULL;
+        fSqes  = NULL;
+    }
+
+    void SubmitToRing(size_t slot)
+    {
+        const Request &req = fRequests[slot];
+
+        const unsigned tail  = *fSqTail;
+        const unsigned index = tail & *fSqMask;
+
+        io_uring_sqe &sqe = fSqes[index];
+        memset(&sqe, 0, sizeof(io_uring_sqe));
+
+        sqe.opcode    = IORING_OP_READ;
+        sqe.fd        = req.fd;
+        sqe.off       = req.pos+req.done;
+        sqe.addr      = reinterpret_cast<uint64_t>(req.dest+req.done);
+        sqe.len       = req.size-req.done;
+        sqe.user_data = slot;
+
+        fSqArray[index] = index;
+
+        // The kernel must see the entry before the new tail
+        __atomic_store_n(fSqTail, tail+1, __ATOMIC_RELEASE);
+
+        fToSubmit++;
+    }
+
+    // The kernel is short of resources (EAGAIN) or the completion queue
+    // is full (EBUSY) only for a while. Give up after about 100ms.
+    int Enter(unsigned toSubmit, unsigned minComplete)
+    {
+        int retries = 0;
+        while (1)
+        {
+            const int rc = syscall(__NR_io_uring_enter, fRing, toSubmit, minComplete,
+                                   minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (rc<0 && errno==EINTR)
+                continue;
+
+            if (rc<0 && (errno==EAGAIN || errno==EBUSY) && retries++<100)
+            {
+                usleep(1000);
+                continue;
+            }
+
+            return rc;
+        }
+    }
+
+    // Reap the completions of all reads the kernel has got, after Wait
+    // failed. Entries which the kernel has not taken from the submission
+    // queue are not read. The destinations must not be freed while the
+    // kernel might still write to them: if even waiting fails, abort.
+    void DrainRing()
+    {
+        const unsigned queued = *fSqTail - __atomic_load_n(fSqHead, __ATOMIC_ACQUIRE);
+
+        unsigned inFlight = fPending-queued;
+        while (inFlight>0)
+        {
+            const unsigned head = *fCqHead;
+
+            if (head==__atomic_load_n(fCqTail, __ATOMIC_ACQUIRE))
+            {
+                if (Enter(0, 1)<0)
+                    abort();
+                continue;
+            }
+
+            __atomic_store_n(fCqHead, head+1, __ATOMIC_RELEASE);
+            inFlight--;
+        }
+
+        fPending = 0;
+    }
+
+    bool WaitForRing(Result &res)
+    {
+        while (1)
+        {
+            const unsigned head = *fCqHead;
+
+            if (head==__atomic_load_n(fCqTail, __ATOMIC_ACQUIRE))
+            {
+                // Pass what was queued and wait for a completion
+                const int rc = Enter(fToSubmit, 1);
+                if (rc<0)
+                    return false;
+
+                fToSubmit -= std::min<unsigned>(rc, fToSubmit);
+                continue;
+            }
+
+            const io_uring_cqe &cqe = fCqes[head & *fCqMask];
+
+            const size_t  slot   = cqe.user_data;
+            const int32_t result = cqe.res;
+
+            __atomic_store_n(fCqHead, head+1, __ATOMIC_RELEASE);
+
+            Request &req = fRequests[slot];
+
+            // Reading is not supported (old kernel): do it here
+            if (result==-EINVAL || result==-EOPNOTSUPP)
+            {
+                res.id     = slot;
+                res.result = ReadBlocking(req);
+                return true;
+            }
+
+            if (result==-EINTR || result==-EAGAIN)
+            {
+                SubmitToRing(slot);
+                continue;
+            }
+
+            // Short read, but not at the end of the file
+            if (result>0 && req.done+result<req.size)
+            {
+                req.done += result;
+                SubmitToRing(slot);
+                continue;
+            }
+
+            if (result>0)
+                req.done += result;
+
+            res.id     = slot;
+            res.result = result<0 ? ssize_t(result) : ssize_t(req.done);
+            return true;
+        }
+    }
+#endif
+
+public:
+    // depth is the maximum number of reads in flight
+    AsyncReader(size_t depth) : fPending(0)
+#ifdef HAVE_IO_URING
+        , fRing(-1), fSqPtr(NULL), fSqSize(0), fCqPtr(NULL), fCqSize(0), fSqes(NULL), fSqesSize(0), fToSubmit(0)
+#endif
+    {
+        fRequests.resize(depth);
+        for (size_t i=0; i<depth; i++)
+            fFree.push_back(depth-1-i);
+
+#ifdef HAVE_IO_URING
+        if (SetupRing(depth))
+            return;
+#endif
+
+        fPool.Start(std::min<size_t>(depth, 16));
+    }
+
+    ~AsyncReader()
+    {
+        // Reads in flight still write to their destination
+        Result res;
+        while (fPending>0 && Wait(res));
+
+#ifdef HAVE_IO_URING
+        if (fPending>0 && fRing>=0)
+            DrainRing();
+
+        CloseRing();
+#endif
+    }
+
+    // Is io_uring used?
+    bool IsUring() const
+    {
+#ifdef HAVE_IO_URING
+        return fRing>=0;
+#else
+        return false;
+#endif
+    }
+
+    // Can another read be submitted?
+    bool IsFull() const { return fFree.empty(); }
+
+    size_t GetNumPending() const { return fPending; }
+
+    // Read size bytes at position pos of fd to dest. The read is only
+    // guaranteed to be passed to the system with the next Wait.
+    bool Submit(uint64_t id, int fd, off_t pos, char *dest, size_t size)
+    {
+        if (fFree.empty())
+            return false;
+
+        const size_t slot = fFree.back();
+        fFree.pop_back();
+
+        const Request req = { id, fd, pos, dest, size, 0 };
+        fRequests[slot] = req;
+
+        fPending++;
+
+#ifdef HAVE_IO_URING
+        if (fRing>=0)
+        {
+            SubmitToRing(slot);
+            return true;
+        }
+#endif
+
+        SubmitToPool(slot);
+        return true;
+    }
+
+    // Wait for any of the submitted reads to finish. Returns false if
+    // nothing is pending or the ring failed.
+    bool Wait(Result &res)
+    {
+        if (fPending==0)
+            return false;
+
+        Result done;
+
+#ifdef HAVE_IO_URING
+        if (fRing>=0)
+        {
+            if (!WaitForRing(done))
+                return false;
+        }
+        else
+#endif
+            done = WaitForPool();
+
+        fPending--;
+        fFree.push_back(done.id);
+
+        res.id     = fRequests[done.id].id;
+        res.result = done.result;
+
+        return true;
+    }
+};
+
+#endif
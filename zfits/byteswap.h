@@ -0,0 +1,124 @@
+#ifndef MARS_byteswap
+#define MARS_byteswap
+
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(__CINT__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BYTESWAP_SIMD
+#include <immintrin.h>
+#endif
+
+// Conversion of arrays of big endian values to the byte order of the
+// host. dest and src must either be the same or must not overlap.
+namespace ByteSwap
+{
+    typedef void (*SwapFunc)(char *dest, const char *src, size_t num);
+
+    inline uint16_t Swap(uint16_t v) { return __builtin_bswap16(v); }
+    inline uint32_t Swap(uint32_t v) { return __builtin_bswap32(v); }
+    inline uint64_t Swap(uint64_t v) { return __builtin_bswap64(v); }
+
+    // One element at a time, T is the unsigned integer of the element's size
+    template<typename T>
+        void SwapScalar(char *dest, const char *src, size_t num)
+    {
+        for (size_t i=0; i<num; i++, src+=sizeof(T), dest+=sizeof(T))
+        {
+            T v;
+            memcpy(&v, src, sizeof(T));
+            v = Swap(v);
+            memcpy(dest, &v, sizeof(T));
+        }
+    }
+
+#ifdef BYTESWAP_SIMD
+    // Shuffle mask reversing the bytes of each element of size N in 16 bytes
+    template<size_t N>
+        __attribute__((target("ssse3")))
+        __m128i Mask128()
+    {
+        alignas(16) char mask[16];
+        for (size_t i=0; i<16; i++)
+            mask[i] = (i/N)*N + N-1-i%N;
+
+        return _mm_load_si128(reinterpret_cast<const __m128i*>(mask));
+    }
+
+    template<size_t N, typename T>
+        __attribute__((target("ssse3")))
+        void SwapSSSE3(char *dest, const char *src, size_t num)
+    {
+        const __m128i mask = Mask128<N>();
+
+        const size_t len = num*N;
+
+        size_t i = 0;
+        for (; i+64<=len; i+=64)
+        {
+            const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+            const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i+16));
+            const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i+32));
+            const __m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i+48));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest+i),    _mm_shuffle_epi8(v0, mask));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest+i+16), _mm_shuffle_epi8(v1, mask));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest+i+32), _mm_shuffle_epi8(v2, mask));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest+i+48), _mm_shuffle_epi8(v3, mask));
+        }
+
+        for (; i+16<=len; i+=16)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest+i), _mm_shuffle_epi8(v, mask));
+        }
+
+        SwapScalar<T>(dest+i, src+i, (len-i)/N);
+    }
+#endif
+
+    // The fastest kernel the CPU supports. An AVX2 version is not faster,
+    // as the copy is limited by the memory bandwidth.
+    template<size_t N, typename T>
+        SwapFunc GetSwapFunc()
+    {
+#ifdef BYTESWAP_SIMD
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("ssse3"))
+            return SwapSSSE3<N, T>;
+#endif
+        return SwapScalar<T>;
+    }
+
+    template<size_t N, typename T>
+        void CopyAs(char *dest, const char *src, size_t num)
+    {
+        static const SwapFunc swap = GetSwapFunc<N, T>();
+        swap(dest, src, num);
+    }
+
+    // Copy num elements of size N from src to dest reversing the byte order of each
+    template<size_t N>
+        void Copy(char *dest, const char *src, size_t num);
+
+    template<>
+        inline void Copy<2>(char *dest, const char *src, size_t num)
+    {
+        CopyAs<2, uint16_t>(dest, src, num);
+    }
+
+    template<>
+        inline void Copy<4>(char *dest, const char *src, size_t num)
+    {
+        CopyAs<4, uint32_t>(dest, src, num);
+    }
+
+    template<>
+        inline void Copy<8>(char *dest, const char *src, size_t num)
+    {
+        CopyAs<8, uint64_t>(dest, src, num);
+    }
+};
+
+#endif
@@ -7,6 +7,11 @@
 
 #include <stdint.h>
 
+#if !defined(__CINT__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_SIMD
+#include <immintrin.h>
+#endif
+
 class Checksum
 {
 public:
@@ -17,6 +22,8 @@ public:
     Checksum(const Checksum &sum) : buffer(sum.buffer) { }
     Checksum(uint64_t v) : buffer(((v>>16)&0xffff) | ((v&0xffff)<<32)) { }
 
+    Checksum &operator=(const Checksum &sum) { buffer = sum.buffer; return *this; }
+
     uint32_t val() const { return (((buffer&0xffff)<<16) | ((buffer>>32)&0xffff)); }
 
     bool valid() const { return buffer==0xffff0000ffff; }
@@ -46,8 +53,159 @@ public:
     }
 
 
+    // The sum of all 16 bit words at even and odd positions. Together
+    // with the carry handling, the order of the additions does not
+    // change the result. The sums are therefore added up in wide
+    // accumulators, independent of the buffer, and folded in at the end.
+    typedef void (*SumFunc)(const char *, size_t, uint64_t &, uint64_t &);
+
+    static void SumWords(const char *buf, size_t len, uint64_t &even, uint64_t &odd)
+    {
+        const uint8_t *ptr = reinterpret_cast<const uint8_t*>(buf);
+        for (const uint8_t *end=ptr+len; ptr<end; ptr+=4)
+        {
+            even += (ptr[0]<<8) | ptr[1];
+            odd  += (ptr[2]<<8) | ptr[3];
+        }
+    }
+
+#ifdef CHECKSUM_SIMD
+    // After swapping the bytes of each word, a 32 bit lane holds an even
+    // word in its lower and an odd word in its upper half. The words are
+    // summed up in 32 bit lanes, which take 65536 words without overflow,
+    // and then added to 64 bit lanes.
+    __attribute__((target("sse2")))
+    static void SumWordsSSE2(const char *buf, size_t len, uint64_t &even, uint64_t &odd)
+    {
+        const __m128i lo16 = _mm_set1_epi32(0xffff);
+        const __m128i lo32 = _mm_set_epi32(0, -1, 0, -1);
+
+        __m128i sumEven = _mm_setzero_si128();
+        __m128i sumOdd  = _mm_setzero_si128();
+
+        size_t num = len/16;
+        while (num>0)
+        {
+            const size_t n = num<65536 ? num : 65536;
+
+            __m128i accEven = _mm_setzero_si128();
+            __m128i accOdd  = _mm_setzero_si128();
+
+            for (size_t i=0; i<n; i++, buf+=16)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+                accEven = _mm_add_epi32(accEven, _mm_and_si128(v, lo16));
+                accOdd  = _mm_add_epi32(accOdd,  _mm_srli_epi32(v, 16));
+            }
+
+            sumEven = _mm_add_epi64(sumEven, _mm_add_epi64(_mm_and_si128(accEven, lo32), _mm_srli_epi64(accEven, 32)));
+            sumOdd  = _mm_add_epi64(sumOdd,  _mm_add_epi64(_mm_and_si128(accOdd,  lo32), _mm_srli_epi64(accOdd,  32)));
+
+            num -= n;
+        }
+
+        uint64_t e[2], o[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(e), sumEven);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o), sumOdd);
+
+        even += e[0] + e[1];
+        odd  += o[0] + o[1];
+
+        SumWords(buf, len%16, even, odd);
+    }
+
+    __attribute__((target("avx2")))
+    static void SumWordsAVX2(const char *buf, size_t len, uint64_t &even, uint64_t &odd)
+    {
+        const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                              1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+        const __m256i lo16 = _mm256_set1_epi32(0xffff);
+        const __m256i lo32 = _mm256_set1_epi64x(0xffffffff);
+
+        __m256i sumEven = _mm256_setzero_si256();
+        __m256i sumOdd  = _mm256_setzero_si256();
+
+        size_t num = len/32;
+        while (num>0)
+        {
+            const size_t n = num<65536 ? num : 65536;
+
+            __m256i accEven = _mm256_setzero_si256();
+            __m256i accOdd  = _mm256_setzero_si256();
+
+            for (size_t i=0; i<n; i++, buf+=32)
+            {
+                const __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf)), swap);
+
+                accEven = _mm256_add_epi32(accEven, _mm256_and_si256(v, lo16));
+                accOdd  = _mm256_add_epi32(accOdd,  _mm256_srli_epi32(v, 16));
+            }
+
+            sumEven = _mm256_add_epi64(sumEven, _mm256_add_epi64(_mm256_and_si256(accEven, lo32), _mm256_srli_epi64(accEven, 32)));
+            sumOdd  = _mm256_add_epi64(sumOdd,  _mm256_add_epi64(_mm256_and_si256(accOdd,  lo32), _mm256_srli_epi64(accOdd,  32)));
+
+            num -= n;
+        }
+
+        uint64_t e[4], o[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(e), sumEven);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), sumOdd);
+
+        even += e[0] + e[1] + e[2] + e[3];
+        odd  += o[0] + o[1] + o[2] + o[3];
+
+        SumWords(buf, len%32, even, odd);
+    }
+
+    // The fastest kernel the CPU supports
+    static SumFunc GetSumFunc()
+    {
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2"))
+            return SumWordsAVX2;
+        if (__builtin_cpu_supports("sse2"))
+            return SumWordsSSE2;
+
+        return SumWords;
+    }
+#endif
+
+    // Add the sums of the even and odd words to the buffer
+    void addSums(uint64_t even, uint64_t odd)
+    {
+        // An even word is the upper half of a 32 bit value. Its bits
+        // beyond 16 are carried into the odd words and vice versa.
+        while (even>0xffff || odd>0xffff)
+        {
+            const uint64_t carry = even>>16;
+
+            even = (even&0xffff) + (odd>>16);
+            odd  = (odd &0xffff) + carry;
+        }
+
+        buffer += even | (odd<<32);
+        HandleCarryBits();
+    }
+
     bool add(const char *buf, size_t len, bool big_endian = true)
     {
+#ifdef CHECKSUM_SIMD
+        if (big_endian && len>=64 && len%4==0)
+        {
+            static const SumFunc sum = GetSumFunc();
+
+            uint64_t even = 0;
+            uint64_t odd  = 0;
+            sum(buf, len, even, odd);
+
+            addSums(even, odd);
+            return true;
+        }
+#endif
+
         // Avoid overflows in carry bits
         if (len>262140) // 2^18-4
         {
@@ -120,6 +278,37 @@ public:
         return add(v.data(), v.size(), big_endian);
     }
 
+    // Add a single byte located at byte position pos of the data stream
+    void addByte(uint8_t byte, size_t pos)
+    {
+        // position within the 4 byte block -> position in buffer
+        static const uint8_t shift[4] = { 8, 0, 40, 32 };
+
+        buffer += uint64_t(byte) << shift[pos%4];
+        HandleCarryBits();
+    }
+
+    // Add len bytes located at byte position pos of the data stream.
+    // Other than for add, neither pos nor len need to be a multiple of 4.
+    bool addAt(const char *buf, size_t len, size_t pos)
+    {
+        for (; len>0 && pos%4!=0; len--)
+            addByte(*buf++, pos++);
+
+        const size_t bulk = len - len%4;
+        if (bulk>0)
+            add(buf, bulk);
+
+        buf += bulk;
+        pos += bulk;
+        len -= bulk;
+
+        for (; len>0; len--)
+            addByte(*buf++, pos++);
+
+        return true;
+    }
+
     std::string str(bool complm=true) const
     {
         std::string rc(16,0);
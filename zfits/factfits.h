@@ -14,27 +14,47 @@ class factfits : public zfits
 {
 public:
     // Default constructor
-    factfits(const std::string& fname, const std::string& tableName="", bool force=false) :
-        zfits(fname, tableName, force),
+    factfits(const std::string& fname, const std::string& tableName="", bool force=false,
+             IOBackend::Type_t backend=IOBackend::kStream) :
+        zfits(fname, tableName, force, backend),
         fOffsetCalibration(0),
         fOffsetStartCellData(0),
         fOffsetData(0),
+        fIndexStartCellData(0),
+        fIndexData(0),
         fNumRoi(0)
     {
         if (init())
-            readDrsCalib(fname);
+            readDrsCalib();
     }
 
     // Alternative constructor
-    factfits(const std::string& fname, const std::string& fout, const std::string& tableName, bool force=false) :
-        zfits(fname, fout, tableName, force),
+    factfits(const std::string& fname, const std::string& fout, const std::string& tableName, bool force=false,
+             IOBackend::Type_t backend=IOBackend::kStream) :
+        zfits(fname, fout, tableName, force, backend),
         fOffsetCalibration(0),
         fOffsetStartCellData(0),
         fOffsetData(0),
+        fIndexStartCellData(0),
+        fIndexData(0),
         fNumRoi(0)
     {
         if (init())
-            readDrsCalib(fname);
+            readDrsCalib();
+    }
+
+    // Read from a backend
+    factfits(IOBackend *backend, const std::string& tableName="", bool force=false) :
+        zfits(backend, tableName, force),
+        fOffsetCalibration(0),
+        fOffsetStartCellData(0),
+        fOffsetData(0),
+        fIndexStartCellData(0),
+        fIndexData(0),
+        fNumRoi(0)
+    {
+        if (init())
+            readDrsCalib();
     }
 
         const std::vector<int16_t> &GetOffsetCalibration() const { return fOffsetCalibration; }
@@ -46,15 +66,55 @@ private:
         zfits::StageRow(row, dest);
 
         // This file does not contain fact data or no calibration to be applied
-        if (fOffsetCalibration.empty())
+        if (fOffsetCalibration.empty() || !IsColumnUncompressed(fIndexData))
             return;
 
         //re-get the pointer to the data to access the offsets
         const uint8_t offset = (row*fTable.bytes_per_row)%4;
 
-        int16_t *startCell = reinterpret_cast<int16_t*>(fBufferRow.data() + offset + fOffsetStartCellData);
-        int16_t *data      = reinterpret_cast<int16_t*>(fBufferRow.data() + offset + fOffsetData);
+        const int16_t *startCell = reinterpret_cast<int16_t*>(fBufferRow.data() + offset + fOffsetStartCellData);
+        int16_t       *data      = reinterpret_cast<int16_t*>(fBufferRow.data() + offset + fOffsetData);
+
+        ApplyCalibration(data, startCell);
+    }
+
+    // The row was uncompressed directly to the user's memory
+    void ProcessDirectRow(const std::vector<char*> &columns)
+    {
+        if (fOffsetCalibration.empty() || !IsColumnUncompressed(fIndexData))
+            return;
+
+        const int16_t *startCell = reinterpret_cast<int16_t*>(columns[fIndexStartCellData]);
+        int16_t       *data      = reinterpret_cast<int16_t*>(columns[fIndexData]);
+
+        ApplyCalibration(data, startCell);
+    }
+
+    // Rows read together by GetRows
+    void ProcessRows(char *rows, size_t numRows)
+    {
+        if (fOffsetCalibration.empty() || !IsColumnUncompressed(fIndexData))
+            return;
+
+        for (size_t i=0; i<numRows; i++, rows+=fTable.bytes_per_row)
+        {
+            const int16_t *startCell = reinterpret_cast<int16_t*>(rows + fOffsetStartCellData);
+            int16_t       *data      = reinterpret_cast<int16_t*>(rows + fOffsetData);
+
+            ApplyCalibration(data, startCell);
+        }
+    }
+
+    // The calibration of Data needs StartCellData
+    void AddRequiredColumns(std::vector<char> &required)
+    {
+        if (!fOffsetCalibration.empty() && required[fIndexData])
+            required[fIndexStartCellData] = true;
+    }
 
+    // Add the offsets which were subtracted before compression
+    void ApplyCalibration(int16_t *data, const int16_t *startCell)
+    {
         // This version is faster because the compilers optimization
         // is not biased by the evaluation of %1024
         for (int ch=0; ch<1440; ch++)
@@ -109,18 +169,42 @@ private:
         fOffsetStartCellData = is->second.offset;
         fOffsetData          = it->second.offset;
 
+        for (size_t i=0; i<fTable.sorted_cols.size(); i++)
+        {
+            if (fTable.sorted_cols[i].num==0)
+                continue;
+
+            if (fTable.sorted_cols[i].offset==fOffsetStartCellData)
+                fIndexStartCellData = i;
+            if (fTable.sorted_cols[i].offset==fOffsetData)
+                fIndexData = i;
+        }
+
         return true;
     }
 
     //  Read the Drs calibration data
-    void readDrsCalib(const std::string& fileName)
+    void readDrsCalib()
     {
         //should not be mandatory, but improves the perfs a lot when reading not compressed, gzipped files
         if (!IsCompressedFITS())
             return;
 
-        zfits calib(fileName, "ZDrsCellOffsets");
+        // The calibration table is read through the same stream or a clone of the
+        // backend. Its header is usually known already from opening the data table.
+        const std::streampos pos = tellg();
+
+        {
+            zfits calib(*this, "ZDrsCellOffsets");
+            readDrsCalib(calib);
+        }
+
+        // Without a backend the stream was shared
+        seekg(pos);
+    }
 
+    void readDrsCalib(zfits &calib)
+    {
         if (calib.bad())
         {
             clear(rdstate()|std::ios::badbit);
@@ -166,6 +250,9 @@ private:
     size_t fOffsetStartCellData;
     size_t fOffsetData;
 
+    size_t fIndexStartCellData; ///< index of StartCellData in the sorted columns
+    size_t fIndexData;          ///< index of Data in the sorted columns
+
     uint16_t fNumRoi;
 
 
@@ -6,6 +6,8 @@ cimport numpy as np
 from libcpp.string cimport string
 from libcpp cimport bool as bool_t
 from libcpp.vector cimport vector
+from libcpp.unordered_map cimport unordered_map
+from libc.stdint cimport uint16_t, uint32_t, int64_t
 from collections import namedtuple
 
 # maybe nice to know ... not needed at the moment.
@@ -47,7 +49,62 @@ cdef extern from "factfits.h":
             T* ptr,
             size_t cnt)
 
-        bool_t GetRow(size_t row, bool_t check)
+        bool_t GetRow(size_t row, bool_t check) except +
+
+        bool_t GetNextRow(bool_t check) except +
+
+        bool_t IsFileOk()
+
+        int64_t GetInt(const string key) except +
+
+        double GetFloat(const string key) except +
+
+        string GetStr(const string key) except +
+
+        void SetReadAhead(size_t numThreads) except +
+
+        size_t RecoverCatalog() except +
+
+        size_t FetchRows(
+            const vector[size_t] &rows,
+            const unordered_map[string, void*] &columns
+        ) except +
+
+
+cdef extern from "FITS.h" namespace "FITS":
+    cdef enum RowOrdering_t:
+        kOrderByCol
+        kOrderByRow
+
+    cdef cppclass Compression:
+        Compression()
+        Compression(const vector[uint16_t] &seq, const RowOrdering_t &order)
+
+
+cdef extern from "zofits.h":
+    cdef cppclass zofits:
+        zofits(
+            const string fname,
+            uint32_t maxCatalogRows,
+            uint32_t numRowsPerTile
+        ) except +
+
+        void SetNumThreads(size_t numThreads) except +
+
+        void AddColumn(
+            const Compression &comp,
+            uint32_t cnt,
+            char type,
+            const string name
+        ) except +
+
+        void SetStr(const string key, const string value) except +
+
+        void WriteTableHeader(const string name) except +
+
+        bool_t WriteRow(const void *ptr, size_t cnt) except +
+
+        bool_t close() except +
 
 cdef class Pyfactfits:
     cdef factfits* c_factfits
@@ -64,9 +121,42 @@ cdef class Pyfactfits:
     def GetRow(self, row, check=True):
         return self.c_factfits.GetRow(row, check)
 
+    def GetNextRow(self, check=True):
+        return self.c_factfits.GetNextRow(check)
+
     def GetNumRows(self):
         return self.c_factfits.GetNumRows()
 
+    def IsFileOk(self):
+        return self.c_factfits.IsFileOk()
+
+    def GetInt(self, key):
+        return self.c_factfits.GetInt(bytes(key, 'ascii'))
+
+    def GetFloat(self, key):
+        return self.c_factfits.GetFloat(bytes(key, 'ascii'))
+
+    def GetStr(self, key):
+        return self.c_factfits.GetStr(bytes(key, 'ascii')).decode('ascii')
+
+    def SetReadAhead(self, num_threads):
+        self.c_factfits.SetReadAhead(num_threads)
+
+    def RecoverCatalog(self):
+        return self.c_factfits.RecoverCatalog()
+
+    def FetchRows(self, rows, name):
+        dtype, width = self.cols_dtypes[name]
+
+        cdef np.ndarray _array = np.zeros((len(rows), width), dtype=dtype)
+
+        cdef unordered_map[string, void*] columns
+        columns[name] = <void*>_array.data
+
+        num = self.c_factfits.FetchRows(rows, columns)
+
+        return _array[:num]
+
     @property
     def cols_dtypes(self):
 
@@ -130,6 +220,47 @@ cdef class Pyfactfits:
         return _array
 
 
+cdef class Pyzofits:
+    cdef zofits* c_zofits
+
+    def __cinit__(self, fname, max_catalog_rows=1000, rows_per_tile=100):
+        self.c_zofits = new zofits(
+            bytes(fname, 'ascii'),
+            max_catalog_rows,
+            rows_per_tile)
+
+    def __dealloc__(self):
+        del self.c_zofits
+
+    def SetNumThreads(self, num_threads):
+        self.c_zofits.SetNumThreads(num_threads)
+
+    def AddColumn(self, name, type_code, count, processings=(0, ), ordering='C'):
+        """processings: the FITS::CompressionProcess_t applied, in order
+        ordering: 'C' (by column) or 'R' (by row)"""
+        cdef vector[uint16_t] seq = processings
+        cdef RowOrdering_t order = kOrderByRow if ordering == 'R' else kOrderByCol
+
+        self.c_zofits.AddColumn(
+            Compression(seq, order),
+            count,
+            ord(type_code),
+            bytes(name, 'ascii'))
+
+    def SetStr(self, key, value):
+        self.c_zofits.SetStr(bytes(key, 'ascii'), bytes(value, 'ascii'))
+
+    def WriteTableHeader(self, name):
+        self.c_zofits.WriteTableHeader(bytes(name, 'ascii'))
+
+    def WriteRow(self, bytes row):
+        cdef const char *ptr = row
+        return self.c_zofits.WriteRow(ptr, len(row))
+
+    def close(self):
+        return self.c_zofits.close()
+
+
 class FactFits:
 
     def __init__(self, fname):
@@ -2,6 +2,7 @@
 #define MARS_fits
 
 #include <stdint.h>
+#include <stdlib.h>
 
 #include <map>
 #include <string>
@@ -15,9 +16,16 @@
 #include <iostream>
 #include <fstream>
 #include <ios>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <condition_variable>
 
 #include "FITS.h"
+#include "byteswap.h"
 #include "checksum.h"
+#include "iobackend.h"
+#include "threadpool.h"
 
 class fits : public std::ifstream
 {
@@ -42,8 +50,61 @@ public:
         std::string comment;
         std::string fitsString;
 
+        // The value is converted once when the header is parsed
+        int64_t integer;   ///< value of 'I' keys (truncated for others, 0/1 for 'B')
+        double  floating;  ///< value of all keys, e.g. also '3.75' (0/1 for 'B')
+
+        // Set the value and its numerical representation
+        void SetValue(const std::string &val)
+        {
+            value = val;
+
+            const char *beg = value.c_str();
+
+            if (type=='B')
+            {
+                integer  = value.find_first_of('T')!=std::string::npos;
+                floating = integer;
+                return;
+            }
+
+            // Also an 'I' key can have an exponent, e.g. 1E5
+            floating = strtod(beg, NULL);
+
+            // Values larger than INT64_MAX are kept as their
+            // unsigned bit pattern to be returned as uint64_t
+            if (type=='I')
+            {
+                integer = *beg=='-' ? strtoll(beg, NULL, 10) : int64_t(strtoull(beg, NULL, 10));
+                return;
+            }
+
+            // Out of range or not a number at all
+            integer = floating>-9.2e18 && floating<9.2e18 ? int64_t(floating) : 0;
+        }
+
+    private:
+        // The whole value, also if it consists of several words
+        std::string GetValue(const std::string *) const
+        {
+            return value;
+        }
+
         template<typename T>
-            T Get() const
+            T GetValue(const T *) const
+        {
+            return Convert<T>(std::is_arithmetic<T>());
+        }
+
+        template<typename T>
+            T Convert(std::true_type) const
+        {
+            return std::is_floating_point<T>::value ? T(floating) : T(integer);
+        }
+
+        // Anything else is still parsed from the string
+        template<typename T>
+            T Convert(std::false_type) const
         {
             T t;
 
@@ -52,6 +113,13 @@ public:
 
             return t;
         }
+
+    public:
+        template<typename T>
+            T Get() const
+        {
+            return GetValue(static_cast<const T*>(0));
+        }
     };
 
     struct Table
@@ -136,17 +204,15 @@ public:
 
         int64_t datasum;
 
-        std::string Trim(const std::string &str, char c=' ') const
+        // Trim leading and trailing spaces of [beg, end)
+        static std::string Trim(const char *beg, const char *end)
         {
-            // Trim Both leading and trailing spaces
-            const size_t pstart = str.find_first_not_of(c); // Find the first character position after excluding leading blank spaces
-            const size_t pend   = str.find_last_not_of(c);  // Find the first character position from reverse af
+            while (beg<end && *beg==' ')
+                beg++;
+            while (end>beg && end[-1]==' ')
+                end--;
 
-            // if all spaces or empty return an empty string
-            if (std::string::npos==pstart || std::string::npos==pend)
-                return std::string();
-
-            return str.substr(pstart, pend-pstart+1);
+            return std::string(beg, end);
         }
 
         bool Check(const std::string &key, char type, const std::string &value="") const
@@ -176,72 +242,76 @@ public:
             return true;
         }
 
-        Keys ParseBlock(const std::vector<std::string> &vec) const
+        // Parse num consecutive 80-byte cards in place
+        Keys ParseBlock(const char *cards, size_t num) const
         {
             Keys rc;
 
-            for (unsigned int i=0; i<vec.size(); i++)
+            for (const char *card=cards; card<cards+num*80; card+=80)
             {
-                const std::string key = Trim(vec[i].substr(0,8));
                 // Keywords without a value, like COMMENT / HISTORY
-                if (vec[i].substr(8,2)!="= ")
+                if (card[8]!='=' || card[9]!=' ')
                     continue;
 
-                char type = 0;
+                const char *end = card+80;
+                const char *beg = card+10;
+                while (beg<end && *beg==' ')
+                    beg++;
+
+                Entry e;
+                e.fitsString = std::string(card, 80);
 
-                std::string com;
-                std::string val = Trim(vec[i].substr(10));
+                std::string val;
 
-                if (val[0]=='\'')
+                if (beg<end && *beg=='\'')
                 {
                     // First skip all '' in the string
-                    size_t p = 1;
-                    while (1)
+                    const char *p = beg+1;
+                    while (p<end)
                     {
-                        const size_t pp = val.find_first_of('\'', p);
-                        if (pp==std::string::npos)
-                            break;
-
-                        p = val[pp+1]=='\'' ? pp+2 : pp+1;
+                        if (*p=='\'')
+                        {
+                            if (p+1==end || p[1]!='\'')
+                                break;
+                            p++;
+                        }
+                        p++;
                     }
 
-                    // Now find the comment
-                    const size_t ppp = val.find_first_of('/', p);
+                    val = Trim(beg+1, p);
 
-                    // Set value, comment and type
-                    // comments could be just spaces. take care of this.
-                    if (ppp!=std::string::npos && val.size()!=ppp+1)
-                        com = Trim(val.substr(ppp+1));
+                    // Now find the comment
+                    const char *c = std::find(std::min(p+1, end), end, '/');
+                    if (c<end)
+                        e.comment = Trim(c+1, end);
 
-                    val  = Trim(val.substr(1, p-2));
-                    type = 'T';
+                    e.type = 'T';
                 }
                 else
                 {
-                    const size_t p = val.find_first_of('/');
+                    const char *c = std::find(beg, end, '/');
+                    if (c<end)
+                        e.comment = Trim(c+1, end);
 
-                    if (p!=std::string::npos && val.size()!=p+1)
-                        com = Trim(val.substr(p+2));
+                    val = Trim(beg, c);
 
-                    val = Trim(val.substr(0, p));
-
-                    if (val.empty() || val.find_first_of('T')!=std::string::npos || val.find_first_of('F')!=std::string::npos)
-                        type = 'B';
+                    if (val.empty() || val.find_first_of("TF")!=std::string::npos)
+                        e.type = 'B';
                     else
-                        type = val.find_last_of('.')==std::string::npos ? 'I' : 'F';
+                        e.type = val.find_first_of('.')==std::string::npos ? 'I' : 'F';
                 }
 
-                const Entry e = { type, val, com, vec[i] };
+                e.SetValue(val);
 
-                rc[key] = e;
+                rc[Trim(card, card+8)] = e;
             }
 
             return rc;
         }
 
         Table() : offset(0), is_compressed(false) { }
-        Table(const std::vector<std::string> &vec, off_t off) : offset(off),
-            keys(ParseBlock(vec))
+        Table(const char *cards, size_t num, off_t off) : offset(off),
+            keys(ParseBlock(cards, num))
         {
             is_compressed = HasKey("ZTABLE") && Check("ZTABLE", 'B', "T");
 
@@ -293,10 +363,9 @@ public:
                 if (comp == "FACT")
                     compress = kCompFACT;
 
-                std::istringstream sin(fmt);
-                int n = 0;
-                sin >> n;
-                if (!sin)
+                char *end = 0;
+                int n = strtol(fmt.c_str(), &end, 10);
+                if (end==fmt.c_str())
                     n = 1;
 
                 const char type = fmt[fmt.length()-1];
@@ -443,6 +512,23 @@ public:
             throw std::runtime_error(txt);
     }
 
+    // How the checksums of the data are computed
+    enum ChecksumPolicy_t
+    {
+        kChecksumOff,       ///< not at all, IsFileOk is always false
+        kChecksumInline,    ///< while reading, on the caller's thread
+        kChecksumBackground ///< by a background thread from a copy of the data
+    };
+
+    // Result of the check of the data checksums
+    enum FileStatus_t
+    {
+        kFileOk,
+        kFileBad,
+        kFilePending,  ///< checksums still being computed in the background
+        kFileUnchecked ///< checksumming is off
+    };
+
     // Public for the root dictionary
     typedef std::pair<void*, Table::Column> Address;
     typedef std::vector<Address> Addresses;
@@ -450,10 +536,34 @@ public:
 
     Table fTable;
 
+    // Header of an HDU and where it is in the file
+    struct HDU
+    {
+        std::string name;   ///< EXTNAME, empty for the primary HDU
+        Table       table;  ///< parsed header, the data starts at table.offset
+        Checksum    header; ///< checksum of the header blocks
+    };
+
+    // The HDUs of a file scanned so far. It is shared by all objects
+    // reading tables of the same file, so they must be used from the
+    // same thread.
+    struct Directory
+    {
+        std::vector<HDU> hdus;
+        std::streamoff   end;  ///< position of the first header not yet scanned
+
+        Directory() : end(0) { }
+    };
+
 protected:
+    std::unique_ptr<IOBackend> fBackend; ///< source of the data, if not the file stream itself
+    std::string                fFileName; ///< name of the file, if opened by name
+
     std::ofstream fCopy;
     std::vector<std::string> fListOfTables; // List of skipped tables. Last table is open table
 
+    std::shared_ptr<Directory> fDirectory; ///< headers of the file, shared with other tables of the same file
+
 
     //map<void*, Table::Column> fAddresses;
     Addresses fAddresses;
@@ -467,92 +577,185 @@ protected:
 
     size_t fRow;
 
+    std::vector<char> fBlock;      ///< rows read at once during sequential access
+    size_t            fBlockFirst; ///< first row in fBlock
+    size_t            fBlockRows;  ///< number of rows in fBlock
+    size_t            fBlockSize;  ///< maximum number of bytes read at once, 0 reads row by row
+    size_t            fLastStaged; ///< last row staged, to detect sequential access
+
     Checksum fChkHeader;
     Checksum fChkData;
 
-    bool ReadBlock(std::vector<std::string> &vec)
+    ChecksumPolicy_t fChecksumPolicy;  ///< how the checksums of the data are computed
+
+    enum { kMaxChecksumsPending = 64 }; ///< copies queued before the reader waits for the background thread
+
+    ThreadPool                                      fChecksumThread;  ///< adds the data to the checksums in the background
+    std::vector<std::unique_ptr<std::vector<char>>> fChecksumBuffers; ///< spare copies of the data for the background thread
+    size_t                                          fChecksumsPending; ///< copies not yet added by the background thread
+    mutable std::mutex                              fChecksumMutex;
+    std::condition_variable                         fChecksumCond;
+
+    // Add len bytes at byte position pos of the data stream to sum,
+    // according to the checksum policy. Only the position modulo 4
+    // matters, see Checksum::addAt.
+    void AddToChecksum(Checksum &sum, const char *buf, size_t len, size_t pos)
     {
-        int endtag = 0;
-        for (int i=0; i<36; i++)
+        if (fChecksumPolicy==kChecksumOff)
+            return;
+
+        if (fChecksumPolicy==kChecksumInline)
         {
-            char c[81];
-            c[80] = 0;
-            read(c, 80);
-            if (!good())
-                break;
+            sum.addAt(buf, len, pos);
+            return;
+        }
 
-            fChkHeader.add(c, 80);
+        std::vector<char> *copy = NULL;
 
-            std::string str(c);
+        {
+            // Do not queue up more data than the thread can follow
+            std::unique_lock<std::mutex> lock(fChecksumMutex);
+            fChecksumCond.wait(lock, [this]() { return fChecksumsPending<kMaxChecksumsPending; });
 
-            if (endtag==2 || str=="END                                                                             ")
+            if (fChecksumBuffers.empty())
+                copy = new std::vector<char>;
+            else
+            {
+                copy = fChecksumBuffers.back().release();
+                fChecksumBuffers.pop_back();
+            }
+
+            fChecksumsPending++;
+        }
+
+        copy->assign(buf, buf+len);
+
+        fChecksumThread.Submit([this, &sum, copy, pos]()
+        {
+            sum.addAt(copy->data(), copy->size(), pos);
+
+            std::lock_guard<std::mutex> lock(fChecksumMutex);
+            fChecksumBuffers.emplace_back(copy);
+            fChecksumsPending--;
+            fChecksumCond.notify_all();
+        });
+    }
+
+    // Append the next 2880-byte block to the header buffer and count
+    // its valid cards. Returns 2 if the END card was found, 1 if only
+    // blank cards followed and 0 if the header continues.
+    int ReadBlock(std::vector<char> &header, size_t &num)
+    {
+        const size_t pos = header.size();
+
+        header.resize(pos+2880);
+
+        char *block = header.data()+pos;
+
+        read(block, 2880);
+        if (!good())
+            return 0;
+
+        fChkHeader.add(block, 2880);
+
+        static const char blank[81] = "                                                                                ";
+
+        int endtag = 0;
+        for (const char *card=block; card<block+2880; card+=80)
+        {
+            if (endtag==2 || (memcmp(card, "END", 3)==0 && memcmp(card+3, blank, 77)==0))
             {
                 endtag = 2; // valid END tag found
                 continue;
             }
 
-            if (endtag==1 || str=="                                                                                ")
+            if (endtag==1 || memcmp(card, blank, 80)==0)
             {
                 endtag = 1; // end tag not found, but expected to be there
                 continue;
             }
 
-            vec.emplace_back(str);
+            num++;
         }
 
-        // Make sure that no empty vector is returned
-        if (endtag && vec.size()%36==0)
-            vec.emplace_back("END     = '' / ");
+        return endtag;
+    }
+
+    // Read through the given backend instead of the file stream.
+    // Takes ownership of the backend.
+    void SetBackend(IOBackend *backend)
+    {
+        fBackend.reset(backend);
+
+        // This also resets the state of the stream
+        std::istream::rdbuf(backend);
 
-        return endtag==2;
+        if (!backend || !backend->is_open())
+            setstate(std::ios::failbit);
     }
 
-    std::string Compile(const std::string &key, int16_t i=-1) const
+    // Read the same file as another object, see fits(const fits&, ...)
+    void Share(const fits &file)
     {
-        return i<0 ? key : key+std::to_string((long long)(i));
+        fFileName  = file.fFileName;
+        fDirectory = file.fDirectory;
+
+        if (file.fBackend)
+            SetBackend(file.fBackend->Clone());
+        else
+            std::istream::rdbuf(file.std::istream::rdbuf());
     }
 
-    void Constructor(const std::string &fname, std::string fout="", const std::string& tableName="", bool force=false)
+    // Open the file with the requested backend
+    void Open(const std::string &fname, IOBackend::Type_t backend)
     {
-        char simple[10];
-        read(simple, 10);
-        if (!good())
-            return;
+        fFileName = fname;
 
-        EnableAddressExceptions();
+        if (backend==IOBackend::kStream)
+            open(fname.c_str());
+        else
+            SetBackend(IOBackend::Create(fname, backend));
+    }
 
-        if (memcmp(simple, "SIMPLE  = ", 10))
+    std::string Compile(const std::string &key, int16_t i=-1) const
+    {
+        return i<0 ? key : key+std::to_string((long long)(i));
+    }
+
+    // Read the next header at the end of the directory and add it.
+    // Returns false if the end of the file was reached and eofok is set
+    // or if the header is not a valid table.
+    bool ReadHDU(bool eofok, bool force)
+    {
+        while (1)
         {
-            clear(rdstate()|std::ios::badbit);
-            throw std::runtime_error("File is not a FITS file.");
-        }
+            seekg(fDirectory->end);
 
-        seekg(0);
+            fChkHeader.reset();
 
-        while (good())
-        {
-            std::vector<std::string> block;
+            std::vector<char> block;
+            size_t num = 0;
             while (1)
             {
                 // If we search for a table, we implicitly assume that
                 // not finding the table is not an error. The user
                 // can easily check that by eof() && !bad()
                 peek();
-                if (eof() && !bad() && !tableName.empty())
+                if (eof() && !bad() && eofok)
                 {
                     break;
                 }
                 // FIXME: Set limit on memory consumption
-                const int rc = ReadBlock(block);
+                const int rc = ReadBlock(block, num);
                 if (!good())
                 {
                     clear(rdstate()|std::ios::badbit);
                     throw std::runtime_error("FITS file corrupted.");
                 }
 
-                if (block.size()%36)
+                if (rc)
                 {
-                    if (!rc && !force)
+                    if (rc!=2 && !force)
                     {
                         clear(rdstate()|std::ios::badbit);
                         throw std::runtime_error("END keyword missing in FITS header.");
@@ -562,48 +765,115 @@ protected:
             }
 
             if (block.empty())
-                break;
+                return false;
+
+            fDirectory->end = tellg();
 
-            if (block[0].substr(0, 9)=="SIMPLE  =")
+            HDU hdu;
+
+            if (memcmp(block.data(), "SIMPLE  =", 9)==0)
             {
-                fChkHeader.reset();
-                continue;
+                hdu.table.keys   = hdu.table.ParseBlock(block.data(), num);
+                hdu.table.offset = tellg();
             }
-
-            if (block[0].substr(0, 9)=="XTENSION=")
+            else
             {
-                fTable = Table(block, tellg());
-                fRow   = (size_t)-1;
+                // Anything else than a table is skipped
+                if (memcmp(block.data(), "XTENSION=", 9))
+                    continue;
 
-                if (!fTable)
+                hdu.table = Table(block.data(), num, tellg());
+                if (!hdu.table)
                 {
                     clear(rdstate()|std::ios::badbit);
-                    return;
+                    return false;
                 }
 
-                const std::string &tname = fTable.Get<std::string>("EXTNAME");
+                hdu.name = hdu.table.name;
 
-                fListOfTables.emplace_back(tname);
+                fDirectory->end += hdu.table.GetTotalBytes();
+            }
 
-                // Check for table name. Skip until eof or requested table are found.
-                // skip the current table?
-                if ((!tableName.empty() && tableName!=tname) || (tableName.empty() && "ZDrsCellOffsets"==tname))
-                {
-                    const streamoff skip = fTable.GetTotalBytes();
-                    seekg(skip, std::ios_base::cur);
+            hdu.header = fChkHeader;
 
-                    fChkHeader.reset();
+            fDirectory->hdus.emplace_back(hdu);
 
-                    continue;
-                }
+            return true;
+        }
+    }
+
+    void Constructor(const std::string &fname, std::string fout="", const std::string& tableName="", bool force=false)
+    {
+        // A new file, otherwise the directory is shared with another table
+        if (!fDirectory)
+        {
+            char simple[10];
+            read(simple, 10);
+            if (!good())
+                return;
 
-                fBufferRow.resize(fTable.bytes_per_row + 8-fTable.bytes_per_row%4);
-                fBufferDat.resize(fTable.bytes_per_row);
+            // A gzip compressed file is inflated by a backend
+            if (memcmp(simple, "\x1f\x8b", 2)==0 && !fBackend && !fFileName.empty())
+            {
+                close();
+                SetBackend(new GzipBackend(fFileName));
 
-                break;
+                read(simple, 10);
+                if (!good())
+                    return;
             }
+
+            EnableAddressExceptions();
+
+            if (memcmp(simple, "SIMPLE  = ", 10))
+            {
+                clear(rdstate()|std::ios::badbit);
+                throw std::runtime_error("File is not a FITS file.");
+            }
+
+            fDirectory = std::make_shared<Directory>();
+        }
+        else
+            EnableAddressExceptions();
+
+        // Headers which were already scanned are taken from the directory,
+        // the following ones are read from the file until the table is found
+        size_t last = 0;
+        for (size_t i=0; good(); i++)
+        {
+            if (i==fDirectory->hdus.size() && !ReadHDU(!tableName.empty(), force))
+                break;
+
+            const HDU &hdu = fDirectory->hdus[i];
+
+            // The primary HDU
+            if (!hdu.table)
+                continue;
+
+            last = i+1;
+
+            fListOfTables.emplace_back(hdu.name);
+
+            // Check for table name. Skip until eof or requested table are found.
+            // skip the current table?
+            if ((!tableName.empty() && tableName!=hdu.name) || (tableName.empty() && "ZDrsCellOffsets"==hdu.name))
+                continue;
+
+            seekg(hdu.table.offset);
+
+            fChkHeader = hdu.header;
+            fRow       = (size_t)-1;
+
+            fBufferRow.resize(hdu.table.bytes_per_row + 8-hdu.table.bytes_per_row%4);
+            fBufferDat.resize(hdu.table.bytes_per_row);
+
+            break;
         }
 
+        // If the table was not found, this is the last one passed
+        if (last)
+            fTable = fDirectory->hdus[last-1].table;
+
         if (fout.empty())
             return;
 
@@ -632,8 +902,12 @@ protected:
     }
 
 public:
-    fits(const std::string &fname, const std::string& tableName="", bool force=false) : std::ifstream(fname.c_str())
+    fits(const std::string &fname, const std::string& tableName="", bool force=false,
+         IOBackend::Type_t backend=IOBackend::kStream) : std::ifstream(),
+        fBlockFirst(0), fBlockRows(0), fBlockSize(8<<20), fLastStaged(-1),
+        fChecksumPolicy(kChecksumInline), fChecksumsPending(0)
     {
+        Open(fname, backend);
         Constructor(fname, "", tableName, force);
         if ((fTable.is_compressed ||fTable.name=="ZDrsCellOffsets") && !force)
         {
@@ -642,8 +916,12 @@ public:
         }
     }
 
-    fits(const std::string &fname, const std::string &fout, const std::string& tableName, bool force=false) : std::ifstream(fname.c_str())
+    fits(const std::string &fname, const std::string &fout, const std::string& tableName, bool force=false,
+         IOBackend::Type_t backend=IOBackend::kStream) : std::ifstream(),
+        fBlockFirst(0), fBlockRows(0), fBlockSize(8<<20), fLastStaged(-1),
+        fChecksumPolicy(kChecksumInline), fChecksumsPending(0)
     {
+        Open(fname, backend);
         Constructor(fname, fout, tableName, force);
         if ((fTable.is_compressed || fTable.name=="ZDrsCellOffsets") && !force)
         {
@@ -652,13 +930,53 @@ public:
         }
     }
 
-    fits() : std::ifstream()
+    // Read from a backend, e.g. a MemoryBackend for a file already in memory.
+    // Takes ownership of the backend.
+    fits(IOBackend *backend, const std::string& tableName="", bool force=false) : std::ifstream(),
+        fBlockFirst(0), fBlockRows(0), fBlockSize(8<<20), fLastStaged(-1),
+        fChecksumPolicy(kChecksumInline), fChecksumsPending(0)
+    {
+        SetBackend(backend);
+        Constructor("", "", tableName, force);
+        if ((fTable.is_compressed || fTable.name=="ZDrsCellOffsets") && !force)
+        {
+            throw std::runtime_error("Trying to read a compressed fits with the base fits class. Use factfits instead.");
+            clear(rdstate()|std::ios::badbit);
+        }
+    }
+
+    // Open another table of the same file. The directory of the headers
+    // is shared, so that a table which was already passed is found with a
+    // single seek. A backend is cloned, otherwise the stream buffer of file
+    // is used: file must not be read while this object reads from it.
+    fits(const fits &file, const std::string& tableName, bool force=false) : std::ifstream(),
+        fBlockFirst(0), fBlockRows(0), fBlockSize(8<<20), fLastStaged(-1),
+        fChecksumPolicy(kChecksumInline), fChecksumsPending(0)
+    {
+        Share(file);
+        Constructor("", "", tableName, force);
+        if ((fTable.is_compressed || fTable.name=="ZDrsCellOffsets") && !force)
+        {
+            throw std::runtime_error("Trying to read a compressed fits with the base fits class. Use factfits instead.");
+            clear(rdstate()|std::ios::badbit);
+        }
+    }
+
+    fits() : std::ifstream(),
+        fBlockFirst(0), fBlockRows(0), fBlockSize(8<<20), fLastStaged(-1),
+        fChecksumPolicy(kChecksumInline), fChecksumsPending(0)
     {
 
     }
 
     ~fits()
     {
+        WaitForChecksums();
+
+        // Reading the rest of the file is only needed for the copy
+        if (!fCopy.is_open())
+            return;
+
         std::copy(std::istreambuf_iterator<char>(*this),
                   std::istreambuf_iterator<char>(),
                   std::ostreambuf_iterator<char>(fCopy));
@@ -666,10 +984,55 @@ public:
 
     virtual void StageRow(size_t row, char* dest)
     {
-        // if (row!=fRow+1) // Fast seeking is ensured by ifstream
-        seekg(fTable.offset+row*fTable.bytes_per_row);
-        read(dest, fTable.bytes_per_row);
-        //fin.clear(fin.rdstate()&~ios::eofbit);
+        const size_t bytes = fTable.bytes_per_row;
+
+        // The row was read with the previous block
+        if (row>=fBlockFirst && row<fBlockFirst+fBlockRows)
+        {
+            memcpy(dest, fBlock.data()+(row-fBlockFirst)*bytes, bytes);
+            fLastStaged = row;
+            return;
+        }
+
+        const bool sequential = row==fLastStaged+1;
+
+        fLastStaged = row;
+
+        const std::streamoff pos = fTable.offset+row*bytes;
+
+        // A backend holding the file in memory needs no read at all
+        const char *mapped = fBackend ? fBackend->Map(pos, bytes) : NULL;
+        if (mapped)
+        {
+            memcpy(dest, mapped, bytes);
+            return;
+        }
+
+        // During sequential access, read as many rows as fit into a block.
+        // The copy file expects the stream to be right after the last row.
+        const size_t num = bytes==0 || fCopy.is_open() ? 0 : std::min(fBlockSize/bytes, fTable.num_rows-row);
+        if (!sequential || num<2)
+        {
+            // if (row!=fRow+1) // Fast seeking is ensured by ifstream
+            seekg(pos);
+            read(dest, bytes);
+            //fin.clear(fin.rdstate()&~ios::eofbit);
+            return;
+        }
+
+        fBlock.resize(num*bytes);
+
+        seekg(pos);
+        read(fBlock.data(), num*bytes);
+
+        fBlockFirst = row;
+        fBlockRows  = gcount()/bytes;
+
+        // A truncated file: the rows which are complete can still be read
+        if (!good() && !bad() && fBlockRows>0)
+            clear(rdstate()&~(std::ios::failbit|std::ios::eofbit));
+
+        memcpy(dest, fBlock.data(), std::min<size_t>(gcount(), bytes));
     }
 
     virtual void WriteRowToCopyFile(size_t row)
@@ -678,7 +1041,7 @@ public:
         {
             const uint8_t offset = (row*fTable.bytes_per_row)%4;
 
-            fChkData.add(fBufferRow);
+            AddToChecksum(fChkData, fBufferRow.data()+offset, fTable.bytes_per_row, offset);
             if (fCopy.is_open() && fCopy.good())
                 fCopy.write(fBufferRow.data()+offset, fTable.bytes_per_row);
             if (!fCopy)
@@ -719,12 +1082,11 @@ public:
         return offset;
     }
 
+    // Copy num big endian elements of size N, vectorized if possible
     template<size_t N>
-        void revcpy(char *dest, const char *src, const int &num)
+        void revcpy(char *dest, const char *src, size_t num)
     {
-        const char *pend = src + num*N;
-        for (const char *ptr = src; ptr<pend; ptr+=N, dest+=N)
-            std::reverse_copy(ptr, ptr+N, dest);
+        ByteSwap::Copy<N>(dest, src, num);
     }
 
     virtual void MoveColumnDataToUserSpace(char *dest, const char *src, const Table::Column& c)
@@ -769,6 +1131,110 @@ public:
         return GetRow(fRow+1, check);
     }
 
+    // Read count rows starting at row first. The rows of each column in
+    // columns are stored one after the other at the given address
+    // (column-major), i.e. row i at address+i*bytes of the column.
+    // Returns the number of rows read.
+    virtual size_t GetRows(size_t first, size_t count, const Pointers &columns)
+    {
+        Addresses addresses;
+        if (!GetColumnAddresses(columns, addresses))
+            return 0;
+
+        if (first>=fTable.num_rows)
+            return 0;
+
+        count = std::min(count, fTable.num_rows-first);
+
+        for (size_t i=0; i<count; i++)
+        {
+            const uint8_t offset = ReadRow(first+i);
+            if (!good())
+                return i;
+
+            const char *ptr = fBufferRow.data() + offset;
+
+            for (Addresses::const_iterator it=addresses.cbegin(); it!=addresses.cend(); it++)
+            {
+                const Table::Column &c = it->second;
+
+                char *dest = reinterpret_cast<char*>(it->first) + i*c.bytes;
+
+                MoveColumnDataToUserSpace(dest, ptr + c.offset, c);
+            }
+        }
+
+        return count;
+    }
+
+    // Read the given rows. For each column in columns, the data of rows[i]
+    // is stored at the given address+i*bytes of the column, as for GetRows.
+    // Neither the checksums nor the current row are changed, the next row
+    // is read from where it would have been before.
+    // Returns the number of rows read.
+    size_t FetchRows(const std::vector<size_t> &rows, const Pointers &columns)
+    {
+        Addresses addresses;
+        if (!GetColumnAddresses(columns, addresses))
+            return 0;
+
+        for (std::vector<size_t>::const_iterator it=rows.cbegin(); it!=rows.cend(); it++)
+            if (*it>=fTable.num_rows)
+                return 0;
+
+        const size_t lastStaged = fLastStaged;
+        const std::streampos where = tellg();
+
+        size_t i = 0;
+        for (; i<rows.size(); i++)
+        {
+            // Unlike ReadRow, the row is not added to the checksum or copied
+            const uint8_t offset = (rows[i]*fTable.bytes_per_row)%4;
+
+            StageRow(rows[i], fBufferRow.data()+offset);
+            if (!good())
+                break;
+
+            const char *ptr = fBufferRow.data() + offset;
+
+            for (Addresses::const_iterator it=addresses.cbegin(); it!=addresses.cend(); it++)
+            {
+                const Table::Column &c = it->second;
+
+                char *dest = reinterpret_cast<char*>(it->first) + i*c.bytes;
+
+                MoveColumnDataToUserSpace(dest, ptr + c.offset, c);
+            }
+        }
+
+        fLastStaged = lastStaged;
+
+        if (good())
+            seekg(where);
+
+        return i;
+    }
+
+    // Look up the columns given to GetRows
+    bool GetColumnAddresses(const Pointers &columns, Addresses &addresses)
+    {
+        for (Pointers::const_iterator it=columns.cbegin(); it!=columns.cend(); it++)
+        {
+            const Table::Columns::const_iterator col = fTable.cols.find(it->first);
+            if (col==fTable.cols.end())
+            {
+                std::ostringstream str;
+                str << "GetRows('" << it->first << "') - Column not found.";
+                Exception(str.str());
+                return false;
+            }
+
+            addresses.emplace_back(it->second, col->second);
+        }
+
+        return true;
+    }
+
     virtual bool SkipNextRow()
     {
         seekg(fTable.offset+(++fRow)*fTable.bytes_per_row);
@@ -931,19 +1397,74 @@ public:
     void PrintKeys(bool all_keys=false) const { fTable.PrintKeys(all_keys); }
     void PrintColumns() const { fTable.PrintColumns(); }
 
+    // Should be set before the first row is read, as the checksums
+    // are incomplete otherwise
+    void SetChecksumPolicy(ChecksumPolicy_t policy)
+    {
+        WaitForChecksums();
+
+        fChecksumPolicy = policy;
+        fChecksumThread.Start(policy==kChecksumBackground ? 1 : 0);
+    }
+
+    ChecksumPolicy_t GetChecksumPolicy() const { return fChecksumPolicy; }
+
+    // Maximum number of bytes of an uncompressed table read at once when
+    // the rows are read one after the other. 0 reads every row on its own.
+    void SetBlockSize(size_t bytes)
+    {
+        fBlockSize = bytes;
+        fBlockRows = 0;
+        fBlock.clear();
+    }
+
+    size_t GetBlockSize() const { return fBlockSize; }
+
+    bool IsChecksumPending() const
+    {
+        std::lock_guard<std::mutex> lock(fChecksumMutex);
+        return fChecksumsPending>0;
+    }
+
+    // Wait until the background thread has added all data to the checksums
+    void WaitForChecksums()
+    {
+        std::unique_lock<std::mutex> lock(fChecksumMutex);
+        fChecksumCond.wait(lock, [this]() { return fChecksumsPending==0; });
+    }
+
+    FileStatus_t GetFileStatus() const
+    {
+        if (fChecksumPolicy==kChecksumOff)
+            return kFileUnchecked;
+
+        if (IsChecksumPending())
+            return kFilePending;
+
+        return IsFileOk() ? kFileOk : kFileBad;
+    }
+
     bool IsHeaderOk() const { return fTable.datasum<0?false:(fChkHeader+Checksum(fTable.datasum)).valid(); }
-    virtual bool IsFileOk() const { return (fChkHeader+fChkData).valid(); }
+
+    // False as long as the checksums are pending, see GetFileStatus
+    virtual bool IsFileOk() const
+    {
+        if (fChecksumPolicy==kChecksumOff || IsChecksumPending())
+            return false;
+
+        return (fChkHeader+fChkData).valid();
+    }
 
     bool IsCompressedFITS() const { return fTable.is_compressed;}
 
     virtual size_t GetNumRows() const
     {
-        return fTable.Get<size_t>("NAXIS2");
+        return fTable.num_rows;
     }
 
     virtual size_t GetBytesPerRow() const
     {
-        return fTable.Get<size_t>("NAXIS1");
+        return fTable.bytes_per_row;
     }
 
     const std::vector<std::string> &GetTables() const
@@ -5,7 +5,7 @@
 #include <stdint.h>
 #include <stdexcept>
 
-#include <set>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <stdio.h>
@@ -20,317 +20,657 @@ namespace Huffman
         return numbits / 8 + (numbits % 8 ? 1 : 0);
     }
 
-    struct TreeNode
+    // The encoder is meant to be reused from chunk to chunk: its
+    // buffers keep their capacity and only the entries of the symbols
+    // of the last chunk are reset, so that building the code of a short
+    // chunk does not touch all 2^16 possible symbols.
+    struct Encoder
     {
-        TreeNode *parent;
-        union
+        // Longer codes are shortened, so that the bit writer never
+        // holds more than 64 bits
+        enum
         {
-            struct
-            {
-                TreeNode *zero, *one;
-            };
-            uint16_t symbol;
+            kMaxCodeLength      = 32,
+            kMaxCanonicalLength = 15  ///< limit of the codes of kFactHuffman16Canonical
         };
 
-        size_t count;
-        bool isLeaf;
-
-        TreeNode(uint16_t sym, size_t cnt=0) : parent(0), isLeaf(true)
+        struct Code
         {
-            symbol = sym;
-            count  = cnt;
-        }
+            uint32_t bits;    ///< code, first bit in the stream is the lowest
+            uint8_t  numbits;
+
+            Code() : bits(0), numbits(0) { }
+        };
 
-        TreeNode(TreeNode *n0=0, TreeNode *n1=0) : parent(0), isLeaf(false)
+        std::vector<uint64_t> fCounts;  ///< occurrences of each symbol, all zero between chunks
+        std::vector<Code>     fLut;     ///< code of each symbol
+        std::vector<uint16_t> fSymbols; ///< symbols of the chunk, ascending by count
+        std::vector<uint16_t> fSorted;  ///< symbols of the chunk, ascending by value
+        std::vector<uint64_t> fWeights; ///< weight of the internal nodes, in the order they are created
+        std::vector<uint32_t> fParents; ///< parents of the leaves followed by those of the internal nodes
+        std::vector<uint32_t> fNumCodes; ///< number of codes of each length
+
+        size_t   fCount;   ///< number of different symbols
+        uint64_t fNumBits; ///< length of the encoded chunk in bits
+
+        // Code lengths with the two-queue algorithm: the leaves sorted by
+        // count are one queue, the internal nodes, which are created in
+        // ascending order of weight, the other one. The two lightest nodes
+        // of both queues are merged until only the root is left.
+        void BuildLengths(std::vector<uint32_t> &numCodes, uint32_t maxLength)
         {
-            count = n0 && n1 ?  n0->count + n1->count : 0;
-            zero  = n0 && n1 ? (n0->count > n1->count ? n0 : n1) : NULL;
-            one   = n0 && n1 ? (n0->count > n1->count ? n1 : n0) : NULL;
+            const size_t n = fSymbols.size();
+
+            fWeights.resize(n-1);
+            fParents.resize(2*n-1);
+
+            size_t leaf = 0;
+            size_t node = 0;
+            for (size_t created=0; created<n-1; created++)
+            {
+                uint64_t weight = 0;
+                for (int k=0; k<2; k++)
+                {
+                    if (leaf<n && (node>=created || fCounts[fSymbols[leaf]]<=fWeights[node]))
+                    {
+                        weight += fCounts[fSymbols[leaf]];
+                        fParents[leaf++] = created;
+                    }
+                    else
+                    {
+                        weight += fWeights[node];
+                        fParents[n + node++] = created;
+                    }
+                }
+
+                fWeights[created] = weight;
+            }
 
-            if (n0)
-                n0->parent = this;
+            // Depth of the internal nodes, overwriting their parents from
+            // the root (the last one) downwards. Leaves deeper than the
+            // limit are counted at the limit.
+            for (size_t i=n-1; i-->0; )
+                fParents[n+i] = i==n-2 ? 0 : fParents[n+fParents[n+i]]+1;
 
-            if (n1)
-                n1->parent = this;
+            numCodes.assign(kMaxCodeLength+1, 0);
+            for (size_t i=0; i<n; i++)
+                numCodes[std::min<uint32_t>(fParents[n+fParents[i]]+1, maxLength)]++;
+
+            LimitLengths(numCodes, maxLength);
         }
 
-        ~TreeNode()
+        // Codes counted at the maximum length might violate the Kraft
+        // inequality. Move leaves down the tree until the code is complete.
+        static void LimitLengths(std::vector<uint32_t> &numCodes, uint32_t maxLength)
         {
-            if (isLeaf)
-                return;
+            uint64_t total = 0;
+            for (int i=maxLength; i>0; i--)
+                total += uint64_t(numCodes[i]) << (maxLength-i);
 
-            if (zero)
-                delete zero;
-            if (one)
-                delete one;
+            while (total>(uint64_t(1)<<maxLength))
+            {
+                numCodes[maxLength]--;
+                for (int i=maxLength-1; i>0; i--)
+                    if (numCodes[i])
+                    {
+                        numCodes[i]--;
+                        numCodes[i+1] += 2;
+                        break;
+                    }
+                total--;
+            }
         }
 
-        bool operator() (const TreeNode *hn1, const TreeNode *hn2) const
+        // Assign the lengths to the symbols, the longest to the rarest,
+        // and the canonical codes of these lengths. Codes of the same
+        // length are ascending with the symbols, so that the codes
+        // follow from the lengths alone.
+        void AssignCodes(const std::vector<uint32_t> &numCodes)
         {
-            return hn1->count < hn2->count;
-        }
-    };
+            uint32_t next[kMaxCodeLength+1];
 
+            uint32_t code = 0;
+            next[0] = 0;
+            for (int i=1; i<=kMaxCodeLength; i++)
+            {
+                code = (code + numCodes[i-1]) << 1;
+                next[i] = code;
+            }
 
-    struct Encoder
-    {
-        struct Code
-        {
-            size_t bits;
-            uint8_t numbits;
+            fNumBits = 0;
 
-            Code() : numbits(0) { }
-        };
+            size_t sym = 0;
+            for (int len=kMaxCodeLength; len>0; len--)
+                for (uint32_t i=0; i<numCodes[len]; i++, sym++)
+                {
+                    fLut[fSymbols[sym]].numbits = len;
+                    fNumBits += fCounts[fSymbols[sym]]*len;
+                }
+
+            for (auto it=fSorted.cbegin(); it!=fSorted.cend(); it++)
+            {
+                Code &c = fLut[*it];
 
-        size_t count;
-        Code lut[1<<16];
+                // The stream is read starting with the lowest bit
+                const uint32_t canonical = next[c.numbits]++;
 
-        bool CreateEncoder(const TreeNode *n, size_t bits=0, uint8_t nbits=0)
+                c.bits = 0;
+                for (int b=0; b<c.numbits; b++)
+                    c.bits |= ((canonical>>(c.numbits-1-b))&1)<<b;
+            }
+        }
+
+        // Build the code of the chunk [bufin, bufin+bufinlen) with codes
+        // of at most maxLength bits. False if the chunk has more
+        // different symbols than codes of that length exist.
+        bool Set(const uint16_t *bufin, size_t bufinlen, uint32_t maxLength=kMaxCodeLength)
         {
-            if (n->isLeaf)
+            for (auto it=fSymbols.cbegin(); it!=fSymbols.cend(); it++)
+                fLut[*it] = Code();
+
+            fSymbols.clear();
+
+            for (const uint16_t *p=bufin; p<bufin+bufinlen; p++)
+                if (fCounts[*p]++==0)
+                    fSymbols.push_back(*p);
+
+            fCount   = fSymbols.size();
+            fNumBits = 0;
+
+            fNumCodes.assign(kMaxCodeLength+1, 0);
+
+            if (fCount>(uint64_t(1)<<maxLength))
             {
-                if (nbits>sizeof(size_t)*8)
-                    throw std::runtime_error("Too many different symbols - this should not happen!");
-                lut[n->symbol].bits    = bits;
-                lut[n->symbol].numbits = nbits==0 ? 1 : nbits;
-                count++;
-                return true;
+                for (auto it=fSymbols.cbegin(); it!=fSymbols.cend(); it++)
+                    fCounts[*it] = 0;
+
+                fSymbols.clear();
+                fSorted.clear();
+                fCount = 0;
+                return false;
             }
 
-            return
-                CreateEncoder(n->zero, bits,              nbits+1) &&
-                CreateEncoder(n->one,  bits | (1<<nbits), nbits+1);
+            fSorted.assign(fSymbols.begin(), fSymbols.end());
+            std::sort(fSorted.begin(), fSorted.end());
 
+            if (fCount>1)
+            {
+                const std::vector<uint64_t> &counts = fCounts;
+                std::sort(fSymbols.begin(), fSymbols.end(), [&counts](uint16_t a, uint16_t b)
+                          { return counts[a]<counts[b] || (counts[a]==counts[b] && a<b); });
+
+                BuildLengths(fNumCodes, maxLength);
+                AssignCodes(fNumCodes);
+            }
+
+            for (auto it=fSymbols.cbegin(); it!=fSymbols.cend(); it++)
+                fCounts[*it] = 0;
+
+            return true;
         }
 
-        void WriteCodeTable(std::string &out) const
+        // Size in bytes of the code table and of the encoded chunk
+        size_t GetCodeTableSize() const
         {
-            out.append((char*)&count, sizeof(size_t));
+            if (fCount==1)
+                return sizeof(size_t)+sizeof(uint16_t);
 
-            for (uint32_t i=0; i<MAX_SYMBOLS; i++)
+            size_t size = sizeof(size_t) + fCount*(sizeof(uint16_t)+sizeof(uint8_t));
+            for (auto it=fSorted.cbegin(); it!=fSorted.cend(); it++)
+                size += numbytes_from_numbits(fLut[*it].numbits);
+
+            return size;
+        }
+
+        size_t GetEncodedSize() const
+        {
+            return numbytes_from_numbits(fNumBits);
+        }
+
+        // Write the code table to out, which has room for GetCodeTableSize bytes
+        char *WriteCodeTable(char *out) const
+        {
+            const size_t count = fCount;
+            memcpy(out, &count, sizeof(size_t));
+            out += sizeof(size_t);
+
+            for (auto it=fSorted.cbegin(); it!=fSorted.cend(); it++)
             {
-                const Code &n = lut[i];
-                if (n.numbits==0)
-                    continue;
+                const uint16_t symbol = *it;
 
                 // Write the 2 byte symbol.
-                out.append((char*)&i, sizeof(uint16_t));
-                if (count==1)
-                    return;
+                memcpy(out, &symbol, sizeof(uint16_t));
+                out += sizeof(uint16_t);
+
+                if (fCount==1)
+                    break;
+
+                // Write the 1 byte code bit length and the code bytes.
+                const Code &c = fLut[symbol];
 
-                // Write the 1 byte code bit length.
-                out.append((char*)&n.numbits, sizeof(uint8_t));
+                *out++ = c.numbits;
 
-                // Write the code bytes.
-                uint32_t numbytes = numbytes_from_numbits(n.numbits);
-                out.append((char*)&n.bits, numbytes);
+                const uint32_t numbytes = numbytes_from_numbits(c.numbits);
+                memcpy(out, &c.bits, numbytes);
+                out += numbytes;
             }
+
+            return out;
         }
 
-        void Encode(std::string &out, const uint16_t *bufin, size_t bufinlen) const
+        uint8_t GetMaxLength() const
         {
-            if (count==1)
-                return;
-
-            uint8_t curbyte = 0;
-            uint8_t curbit  = 0;
+            uint8_t len = kMaxCodeLength;
+            while (len>0 && fNumCodes[len]==0)
+                len--;
+            return len;
+        }
 
-            for (uint32_t i=0; i<bufinlen; ++i)
-            {
-                const uint16_t &symbol = bufin[i];
+        // The code table of kFactHuffman16Canonical: the maximum code
+        // length L, the number of codes of each length from 1 to L and
+        // the symbols ordered by their codes. With L=0 only the one
+        // symbol of the chunk follows.
+        size_t GetCanonicalTableSize() const
+        {
+            const uint8_t len = GetMaxLength();
+            return sizeof(uint8_t) + len*sizeof(uint16_t) + std::max<size_t>(fCount, 1)*sizeof(uint16_t);
+        }
 
-                const Code *code = lut+symbol;
+        // Write the code table to out, which has room for GetCanonicalTableSize bytes
+        char *WriteCanonicalTable(char *out) const
+        {
+            const uint8_t maxlen = GetMaxLength();
+            *out++ = maxlen;
 
-                uint8_t nbits = code->numbits;
-                const uint8_t *bits = (uint8_t*)&code->bits;
+            if (maxlen==0)
+            {
+                const uint16_t symbol = fCount==0 ? 0 : fSorted[0];
+                memcpy(out, &symbol, sizeof(uint16_t));
+                return out+sizeof(uint16_t);
+            }
 
-                while (nbits>0)
-                {
-                    // Number of bits available in the current byte
-                    const uint8_t free_bits = 8 - curbit;
+            for (uint8_t len=1; len<=maxlen; len++)
+            {
+                const uint16_t num = fNumCodes[len];
+                memcpy(out, &num, sizeof(uint16_t));
+                out += sizeof(uint16_t);
+            }
 
-                    // Write bits to current byte
-                    curbyte |= *bits<<curbit;
+            for (uint8_t len=1; len<=maxlen; len++)
+            {
+                if (fNumCodes[len]==0)
+                    continue;
 
-                    // If the byte has been filled, put it into the output buffer
-                    // If the bits exceed the current byte step to the next byte
-                    // and fill it properly
-                    if (nbits>=free_bits)
+                for (auto it=fSorted.cbegin(); it!=fSorted.cend(); it++)
+                    if (fLut[*it].numbits==len)
                     {
-                        out += curbyte;
-                        curbyte = *bits>>free_bits;
-
-                        bits++;
+                        memcpy(out, &*it, sizeof(uint16_t));
+                        out += sizeof(uint16_t);
                     }
-
-                    // Adapt the number of available bits, the number of consumed bits
-                    // and the bit-pointer accordingly
-                    const uint8_t consumed = nbits>8 ? 8 : nbits;
-                    nbits  -= consumed;
-                    curbit += consumed;
-                    curbit %= 8;
-                }
             }
 
-            // If the buffer-byte is half-full, also add it to the output buffer
-            if (curbit>0)
-                out += curbyte;
+            return out;
         }
 
-        Encoder(const uint16_t *bufin, size_t bufinlen) : count(0)
+        // Encode the chunk to out, which has room for GetEncodedSize bytes.
+        // The bits are collected in a 64 bit word which is flushed 32 bits
+        // at a time.
+        char *Encode(char *out, const uint16_t *bufin, size_t bufinlen) const
         {
-            uint64_t counts[MAX_SYMBOLS];
-            memset(counts, 0, sizeof(uint64_t)*MAX_SYMBOLS);
+            if (fCount<=1)
+                return out;
 
-            // Count occurances
-            for (const uint16_t *p=bufin; p<bufin+bufinlen; p++)
-                counts[*p]++;
-
-            // Copy all occuring symbols into a sorted list
-            std::multiset<TreeNode*, TreeNode> set;
-            for (int i=0; i<MAX_SYMBOLS; i++)
-                if (counts[i])
-                    set.insert(new TreeNode(i, counts[i]));
+            uint64_t bitbuf = 0;
+            uint32_t nbits  = 0;
 
-            // Create the tree bottom-up
-            while (set.size()>1)
+            for (const uint16_t *p=bufin; p<bufin+bufinlen; p++)
             {
-                auto it = set.begin();
+                const Code &c = fLut[*p];
 
-                auto it1 = it++;
-                auto it2 = it;
+                bitbuf |= uint64_t(c.bits) << nbits;
+                nbits  += c.numbits;
 
-                TreeNode *nn = new TreeNode(*it1, *it2);
-
-                set.erase(it1, ++it2);
+                if (nbits>=32)
+                {
+                    const uint32_t word = bitbuf;
+                    memcpy(out, &word, sizeof(uint32_t));
+                    out += sizeof(uint32_t);
 
-                set.insert(nn);
+                    bitbuf >>= 32;
+                    nbits   -= 32;
+                }
             }
 
-            // get the root of the tree
-            const TreeNode *root = *set.begin();
+            // The remaining bits, the last byte possibly half-full
+            for (; nbits>0; nbits -= std::min<uint32_t>(nbits, 8), bitbuf >>= 8)
+                *out++ = bitbuf&0xff;
 
-            CreateEncoder(root);
+            return out;
+        }
 
-            // This will delete the whole tree
-            delete root;
+        Encoder() : fCounts(MAX_SYMBOLS), fLut(MAX_SYMBOLS), fCount(0), fNumBits(0)
+        {
         }
 
+        Encoder(const uint16_t *bufin, size_t bufinlen) : fCounts(MAX_SYMBOLS), fLut(MAX_SYMBOLS), fCount(0), fNumBits(0)
+        {
+            Set(bufin, bufinlen);
+        }
     };
 
 
 
-    struct Decoder
+    // Output of the decoder which just stores the decoded symbols.
+    // Other outputs can transform the symbols on the fly.
+    struct Store
     {
-        uint16_t symbol;
-        uint8_t nbits;
-        bool isLeaf;
-
-        Decoder *lut;
-
-        Decoder() : isLeaf(false), lut(NULL)
+        void operator()(uint16_t *out, uint16_t symbol)
         {
+            *out = symbol;
         }
 
-        ~Decoder()
+        // Store count (1-3) symbols. There is always room for three.
+        void operator()(uint16_t *out, const uint16_t *symbols, uint8_t)
         {
-            if (lut)
-                delete [] lut;
+            out[0] = symbols[0];
+            out[1] = symbols[1];
+            out[2] = symbols[2];
         }
+    };
 
-        void Set(uint16_t sym, uint8_t n=0, size_t bits=0)
+    struct Decoder
+    {
+        // Number of bits looked up at once in the root table
+        enum { kTableBits = 11 };
+
+        // One entry of a lookup table. An entry of the root table holds as
+        // many consecutive symbols as fit completely into kTableBits, so that
+        // the frequent short codes are decoded several at a time. Codes longer
+        // than a table continue in a sub-table the entry links to.
+        struct Entry
         {
-            if (!lut)
-                lut = new Decoder[256];
+            uint16_t symbols[3]; ///< decoded symbols. For a link: offset of the sub-table (0,1) and its number of bits (2)
+            uint8_t  count;      ///< number of decoded symbols, 0 for a link to a sub-table
+            uint8_t  nbits;      ///< bits consumed by all symbols (low nibble) and by the first symbol only (high nibble)
+        };
 
-            if (n>8)
+        struct Code
+        {
+            uint64_t bits;
+            uint8_t  numbits;
+            uint16_t symbol;
+        };
+
+        // All buffers keep their capacity between code tables, so that
+        // after the first few tables no memory is allocated anymore
+        std::vector<Entry>   fTable;     ///< root table followed by all sub-tables
+        std::vector<Entry>   fSingle;    ///< root table before the symbols are combined
+        std::vector<Code>    fCodes;     ///< codes of the current table
+        std::vector<uint8_t> fCodeTable; ///< serialized code table the tables were built from
+
+        bool     fOneSymbol; ///< only one symbol in the stream, no bits encoded
+        uint16_t fSymbol;    ///< the one symbol if fOneSymbol
+
+        // Fill the table starting at fTable[pos] with 2^width entries from
+        // the codes [beg, end) of which shift bits have already been consumed
+        void BuildTable(std::vector<Code>::iterator beg, std::vector<Code>::iterator end,
+                        size_t pos, uint8_t shift, uint8_t width)
+        {
+            const uint64_t mask = (uint64_t(1)<<width)-1;
+
+            // Codes fitting into this table. Fill all entries which start with the code.
+            for (auto it=beg; it!=end; it++)
             {
-                lut[bits&0xff].Set(sym, n-8, bits>>8);
-                return;
+                const uint8_t n = it->numbits-shift;
+                if (n>width)
+                    continue;
+
+                const uint64_t key = (it->bits>>shift) & ((uint64_t(1)<<n)-1);
+                for (uint64_t i=0; i<(uint64_t(1)<<(width-n)); i++)
+                {
+                    Entry &e = fTable[pos + (key | (i<<n))];
+
+                    e.symbols[0] = it->symbol;
+                    e.count      = 1;
+                    e.nbits      = n | (n<<4);
+                }
             }
 
-            const int nn = 1<<(8-n);
+            // Longer codes: group them by the bits looked up in this table
+            // and build one sub-table per group
+            const auto islong = [shift, width](const Code &c) { return c.numbits-shift>width; };
+            const auto first  = std::partition(beg, end, [&islong](const Code &c) { return !islong(c); });
+
+            std::sort(first, end, [shift, mask](const Code &a, const Code &b)
+                      { return ((a.bits>>shift)&mask) < ((b.bits>>shift)&mask); });
 
-            for (int i=0; i<nn; i++)
+            for (auto it=first; it!=end; )
             {
-                const uint8_t key = bits | (i<<n);
+                const uint64_t key = (it->bits>>shift) & mask;
+
+                auto last = it;
+                uint8_t maxbits = 0;
+                for (; last!=end && ((last->bits>>shift)&mask)==key; last++)
+                    maxbits = std::max(maxbits, last->numbits);
+
+                const uint8_t  subwidth = std::min<uint8_t>(kTableBits, maxbits-shift-width);
+                const uint32_t subpos   = fTable.size();
+
+                fTable.resize(subpos + (size_t(1)<<subwidth), Entry());
+
+                Entry &e = fTable[pos+key];
+                e.symbols[0] = subpos&0xffff;
+                e.symbols[1] = subpos>>16;
+                e.symbols[2] = subwidth;
+                e.count      = 0;
+                e.nbits      = width;
+
+                BuildTable(it, last, subpos, shift+width, subwidth);
 
-                lut[key].symbol = sym;
-                lut[key].isLeaf = true;
-                lut[key].nbits  = n;
+                it = last;
             }
         }
 
-        void Build(const TreeNode &p, uint64_t bits=0, uint8_t n=0)
+        // Append to each entry of the root table the symbols which
+        // follow the first one and still fit completely into the entry
+        void CombineSymbols()
         {
-            if (p.isLeaf)
+            fSingle.assign(fTable.begin(), fTable.begin()+(1<<kTableBits));
+
+            const uint32_t mask = (1<<kTableBits)-1;
+            for (uint32_t i=0; i<(1U<<kTableBits); i++)
             {
-                Set(p.symbol, n, bits);
-                return;
+                Entry &e = fTable[i];
+                if (e.count==0)
+                    continue;
+
+                uint8_t nbits = e.nbits&0xf;
+                while (e.count<3)
+                {
+                    const Entry &next = fSingle[(i>>nbits)&mask];
+                    if (next.count==0 || nbits+(next.nbits&0xf)>kTableBits)
+                        break;
+
+                    e.symbols[e.count++] = next.symbols[0];
+                    nbits += next.nbits&0xf;
+                }
+
+                e.nbits = (e.nbits&0xf0) | nbits;
             }
+        }
 
-            Build(*p.zero, bits,          n+1);
-            Build(*p.one,  bits | (1<<n), n+1);
+        void Build()
+        {
+            fTable.assign(1<<kTableBits, Entry());
+
+            BuildTable(fCodes.begin(), fCodes.end(), 0, 0, kTableBits);
+            CombineSymbols();
         }
 
-        Decoder(const TreeNode &p) : symbol(0), isLeaf(false), lut(NULL)
+        // Make sure that at least 56 bits are in the bit buffer as long as
+        // there is input left. Bits beyond the end of the input are zero.
+        static void Refill(const uint8_t *&in_ptr, const uint8_t *in_end, uint64_t &bitbuf, int32_t &avail)
         {
-            Build(p);
+            if (in_end-in_ptr>=8)
+            {
+                uint64_t word;
+                memcpy(&word, in_ptr, sizeof(uint64_t));
+
+                bitbuf |= word << avail;
+                in_ptr += (63-avail)>>3;
+                avail  |= 56;
+                return;
+            }
+
+            while (avail<=56 && in_ptr<in_end)
+            {
+                bitbuf |= uint64_t(*in_ptr++) << avail;
+                avail  += 8;
+            }
         }
 
+        // Decode the bit stream [in_ptr, in_end) into [out_ptr, out_end).
+        // The symbols are written by output, see Huffman::Store.
+        template<class Output>
         const uint8_t *Decode(const uint8_t *in_ptr, const uint8_t *in_end,
-                              uint16_t *out_ptr, const uint16_t *out_end) const
+                              uint16_t *out_ptr, const uint16_t *out_end,
+                              Output &output) const
         {
-            Decoder const *p = this;
-
-            if (in_ptr==in_end)
+            if (fOneSymbol)
             {
                 while (out_ptr < out_end)
-                    *out_ptr++ = p->lut->symbol;
+                    output(out_ptr++, fSymbol);
                 return in_ptr;
             }
 
-            uint8_t curbit = 0;
-            while (in_ptr<in_end && out_ptr<out_end)
+            const uint8_t *in_start = in_ptr;
+
+            const Entry   *root = fTable.data();
+            const uint64_t mask = (1<<kTableBits)-1;
+
+            uint64_t bitbuf = 0;
+            int32_t  avail  = 0;
+
+            while (out_ptr<out_end)
             {
-                const uint16_t *two = (uint16_t*)in_ptr;
+                // The input could be exhausted before the output is complete
+                if (avail<0)
+                    throw std::runtime_error("Unexpected end of bit stream!");
 
-                const uint8_t curbyte = (*two >> curbit);
+                Refill(in_ptr, in_end, bitbuf, avail);
 
-                if (!p->lut)
-                    throw std::runtime_error("Unknown bitcode in stream!");
+                const Entry *e = root + (bitbuf&mask);
 
-                p = p->lut + curbyte;
-                if (!p->isLeaf)
+                // Fast path: emit all symbols of the entry at once
+                if (e->count>0 && out_end-out_ptr>=3)
                 {
-                    in_ptr++;
+                    output(out_ptr, e->symbols, e->count);
+                    out_ptr += e->count;
+
+                    bitbuf >>= e->nbits&0xf;
+                    avail   -= e->nbits&0xf;
                     continue;
                 }
 
-                *out_ptr++ = p->symbol;
-                curbit += p->nbits;
+                // Long code: walk through the sub-tables
+                while (e->count==0)
+                {
+                    if (e->symbols[2]==0)
+                        throw std::runtime_error("Unknown bitcode in stream!");
+
+                    bitbuf >>= e->nbits;
+                    avail   -= e->nbits;
 
-                p = this;
+                    if (avail<0)
+                        throw std::runtime_error("Unexpected end of bit stream!");
 
-                if (curbit>=8)
-                {
-                    curbit %= 8;
-                    in_ptr++;
+                    Refill(in_ptr, in_end, bitbuf, avail);
+
+                    const uint32_t sub = e->symbols[0] | (uint32_t(e->symbols[1])<<16);
+                    e = fTable.data() + sub + (bitbuf & ((uint64_t(1)<<e->symbols[2])-1));
                 }
 
+                // Close to the end of the output: emit only the first symbol
+                output(out_ptr++, e->symbols[0]);
+
+                bitbuf >>= e->nbits>>4;
+                avail   -= e->nbits>>4;
+            }
+
+            if (avail<0)
+                throw std::runtime_error("Unexpected end of bit stream!");
+
+            // Bytes of which at least one bit was consumed
+            const int64_t numbits = (in_ptr-in_start)*8 - avail;
+            return in_start + numbytes_from_numbits(numbits);
+        }
+
+        const uint8_t *Decode(const uint8_t *in_ptr, const uint8_t *in_end,
+                              uint16_t *out_ptr, const uint16_t *out_end) const
+        {
+            Store store;
+            return Decode(in_ptr, in_end, out_ptr, out_end, store);
+        }
+
+        // Size in bytes of the serialized code table at bufin, which
+        // must end before in_end
+        static size_t GetCodeTableSize(const uint8_t *bufin, const uint8_t *in_end)
+        {
+            size_t count=0;
+            if (size_t(in_end-bufin)<sizeof(count))
+                throw std::runtime_error("Huffman code table exceeds the coded chunk.");
+
+            memcpy(&count, bufin, sizeof(count));
+
+            if (count==1)
+            {
+                if (size_t(in_end-bufin)<sizeof(count)+sizeof(uint16_t))
+                    throw std::runtime_error("Huffman code table exceeds the coded chunk.");
+
+                return sizeof(count)+sizeof(uint16_t);
             }
 
-            return curbit ? in_ptr+1 : in_ptr;
+            const uint8_t *ptr = bufin+sizeof(count);
+            for (size_t i=0; i<count; i++)
+            {
+                if (size_t(in_end-ptr)<sizeof(uint16_t)+sizeof(uint8_t))
+                    throw std::runtime_error("Huffman code table exceeds the coded chunk.");
+
+                const size_t len = sizeof(uint16_t) + sizeof(uint8_t) + numbytes_from_numbits(ptr[sizeof(uint16_t)]);
+                if (size_t(in_end-ptr)<len)
+                    throw std::runtime_error("Huffman code table exceeds the coded chunk.");
+
+                ptr += len;
+            }
+
+            return ptr-bufin;
         }
 
-        Decoder(const uint8_t* bufin, int64_t &pindex) : isLeaf(false), lut(NULL)
+        // Read the code table at bufin+pindex, which must end before in_end,
+        // and build the lookup tables. If the table is identical to the
+        // previous one, the lookup tables are kept as they are.
+        void Set(const uint8_t* bufin, int64_t &pindex, const uint8_t *in_end)
         {
-            // FIXME: Sanity check for size missing....
+            const uint8_t *table = bufin + pindex;
+            const size_t   size  = GetCodeTableSize(table, in_end);
+
+            if (size==fCodeTable.size() && memcmp(table, fCodeTable.data(), size)==0)
+            {
+                pindex += size;
+                return;
+            }
+
+            // In case of an exception, this table has to be rebuilt next time
+            fCodeTable.clear();
 
             // Read the number of entries.
             size_t count=0;
             memcpy(&count, bufin + pindex, sizeof(count));
             pindex += sizeof(count);
+
+            fOneSymbol = false;
+            fCodes.clear();
+
             // Read the entries.
             for (size_t i=0; i<count; i++)
             {
@@ -340,7 +680,8 @@ namespace Huffman
 
                 if (count==1)
                 {
-                    Set(sym);
+                    fOneSymbol = true;
+                    fSymbol    = sym;
                     break;
                 }
 
@@ -352,49 +693,321 @@ namespace Huffman
 
                 if (numbytes>sizeof(size_t))
                     throw std::runtime_error("Number of bytes for a single symbol exceeds maximum.");
+                if (numbits==0)
+                    throw std::runtime_error("Code of zero length in code table.");
                 size_t bits=0;
                 memcpy(&bits, bufin+pindex, numbytes);
                 pindex += numbytes;
 
-                Set(sym, numbits, bits);
+                const Code code = { bits, numbits, sym };
+                fCodes.push_back(code);
             }
+
+            if (!fOneSymbol)
+                Build();
+
+            fCodeTable.assign(table, table+size);
+        }
+
+        Decoder() : fOneSymbol(false), fSymbol(0)
+        {
+        }
+
+        Decoder(const uint8_t* bufin, int64_t &pindex, const uint8_t *in_end) : fOneSymbol(false), fSymbol(0)
+        {
+            Set(bufin, pindex, in_end);
         }
     };
 
+    // Decoder of canonical codes of at most 15 bits (kFactHuffman16Canonical).
+    // As only the code lengths are stored, the codes are rebuilt from
+    // them into a single table indexed by as many bits as the longest code.
+    struct CanonicalDecoder
+    {
+        enum { kMaxCodeLength = Encoder::kMaxCanonicalLength };
+
+        struct Entry
+        {
+            uint16_t symbol;
+            uint8_t  numbits; ///< 0 if no code starts with these bits
+        };
+
+        std::vector<Entry>   fTable;     ///< 2^fMaxBits entries
+        std::vector<uint8_t> fCodeTable; ///< serialized code table the table was built from
+
+        uint8_t  fMaxBits;   ///< length of the longest code
+        bool     fOneSymbol; ///< only one symbol in the stream, no bits encoded
+        uint16_t fSymbol;    ///< the one symbol if fOneSymbol
+
+        // Size in bytes of the serialized code table at bufin, which
+        // must end before in_end
+        static size_t GetCodeTableSize(const uint8_t *bufin, const uint8_t *in_end)
+        {
+            if (in_end-bufin<1)
+                throw std::runtime_error("Canonical Huffman code table exceeds the coded chunk.");
+
+            const uint8_t maxbits = bufin[0];
+
+            // The counts of the codes of each length, or the one symbol
+            const size_t head = sizeof(uint8_t) + std::max<size_t>(maxbits, 1)*sizeof(uint16_t);
+            if (size_t(in_end-bufin)<head)
+                throw std::runtime_error("Canonical Huffman code table exceeds the coded chunk.");
+
+            if (maxbits==0)
+                return head;
+
+            size_t count = 0;
+            for (uint8_t len=0; len<maxbits; len++)
+            {
+                uint16_t num;
+                memcpy(&num, bufin+sizeof(uint8_t)+len*sizeof(uint16_t), sizeof(uint16_t));
+                count += num;
+            }
+
+            if ((in_end-bufin-head)/sizeof(uint16_t)<count)
+                throw std::runtime_error("Canonical Huffman code table exceeds the coded chunk.");
+
+            return head + count*sizeof(uint16_t);
+        }
+
+        // Read the code table at bufin+pindex, which must end before in_end,
+        // and build the lookup table. If the table is identical to the
+        // previous one, it is kept.
+        void Set(const uint8_t* bufin, int64_t &pindex, const uint8_t *in_end)
+        {
+            const uint8_t *table = bufin + pindex;
+            const size_t   size  = GetCodeTableSize(table, in_end);
+
+            if (table[0]>kMaxCodeLength)
+                throw std::runtime_error("Code length of canonical Huffman code exceeds maximum.");
+
+            pindex += size;
+
+            if (size==fCodeTable.size() && memcmp(table, fCodeTable.data(), size)==0)
+                return;
+
+            // In case of an exception, this table has to be rebuilt next time
+            fCodeTable.clear();
+
+            fMaxBits   = table[0];
+            fOneSymbol = fMaxBits==0;
+
+            const uint8_t *ptr = table+sizeof(uint8_t);
+
+            if (fOneSymbol)
+            {
+                memcpy(&fSymbol, ptr, sizeof(uint16_t));
+                fCodeTable.assign(table, table+size);
+                return;
+            }
+
+            const uint8_t *symbols = ptr + fMaxBits*sizeof(uint16_t);
+
+            fTable.assign(size_t(1)<<fMaxBits, Entry());
+
+            uint32_t code = 0;
+            for (uint8_t len=1; len<=fMaxBits; len++, code<<=1)
+            {
+                uint16_t num;
+                memcpy(&num, ptr+(len-1)*sizeof(uint16_t), sizeof(uint16_t));
+
+                if (code+num > (1U<<len))
+                    throw std::runtime_error("Invalid canonical Huffman code table.");
+
+                for (uint16_t i=0; i<num; i++, code++)
+                {
+                    // The stream is read starting with the lowest bit
+                    uint32_t key = 0;
+                    for (uint8_t b=0; b<len; b++)
+                        key |= ((code>>(len-1-b))&1)<<b;
+
+                    Entry e;
+                    memcpy(&e.symbol, symbols, sizeof(uint16_t));
+                    e.numbits = len;
+                    symbols += sizeof(uint16_t);
+
+                    // All entries which start with the code
+                    for (uint32_t k=key; k<fTable.size(); k+=1U<<len)
+                        fTable[k] = e;
+                }
+            }
+
+            fCodeTable.assign(table, table+size);
+        }
+
+        // Decode the bit stream [in_ptr, in_end) into [out_ptr, out_end).
+        // The symbols are written by output, see Huffman::Store.
+        template<class Output>
+        const uint8_t *Decode(const uint8_t *in_ptr, const uint8_t *in_end,
+                              uint16_t *out_ptr, const uint16_t *out_end,
+                              Output &output) const
+        {
+            if (fOneSymbol)
+            {
+                while (out_ptr < out_end)
+                    output(out_ptr++, fSymbol);
+                return in_ptr;
+            }
+
+            const uint8_t *in_start = in_ptr;
+
+            const Entry   *table = fTable.data();
+            const uint64_t mask  = fTable.size()-1;
+
+            uint64_t bitbuf = 0;
+            int32_t  avail  = 0;
+
+            while (out_ptr<out_end)
+            {
+                if (avail<0)
+                    throw std::runtime_error("Unexpected end of bit stream!");
+
+                Decoder::Refill(in_ptr, in_end, bitbuf, avail);
+
+                // The 56 bits of a refill hold three codes
+                for (int k=0; k<3 && out_ptr<out_end; k++)
+                {
+                    const Entry &e = table[bitbuf&mask];
+                    if (e.numbits==0)
+                        throw std::runtime_error("Unknown bitcode in stream!");
+
+                    output(out_ptr++, e.symbol);
+
+                    bitbuf >>= e.numbits;
+                    avail   -= e.numbits;
+                }
+            }
+
+            if (avail<0)
+                throw std::runtime_error("Unexpected end of bit stream!");
+
+            // Bytes of which at least one bit was consumed
+            const int64_t numbits = (in_ptr-in_start)*8 - avail;
+            return in_start + numbytes_from_numbits(numbits);
+        }
+
+        CanonicalDecoder() : fMaxBits(0), fOneSymbol(false), fSymbol(0)
+        {
+        }
+    };
+
+    // Encode with an encoder which is reused from call to call
+    inline bool Encode(std::string &bufout, const uint16_t *bufin, size_t bufinlen, Encoder &encoder)
+    {
+        encoder.Set(bufin, bufinlen);
+
+        const size_t pos = bufout.size();
+        bufout.resize(pos + sizeof(size_t) + encoder.GetCodeTableSize() + encoder.GetEncodedSize());
+
+        char *out = &bufout[pos];
+        memcpy(out, &bufinlen, sizeof(size_t));
+
+        out = encoder.WriteCodeTable(out+sizeof(size_t));
+        encoder.Encode(out, bufin, bufinlen);
+
+        return true;
+    }
+
     inline bool Encode(std::string &bufout, const uint16_t *bufin, size_t bufinlen)
     {
-        const Encoder encoder(bufin, bufinlen);
+        Encoder encoder;
+        return Encode(bufout, bufin, bufinlen, encoder);
+    }
+
+    // Encode as kFactHuffman16Canonical. The chunk starts with the number
+    // of symbols like for kFactHuffman16, followed by the canonical code
+    // table. False if the chunk has too many different symbols for codes
+    // of at most 15 bits, nothing is appended then.
+    inline bool EncodeCanonical(std::string &bufout, const uint16_t *bufin, size_t bufinlen, Encoder &encoder)
+    {
+        if (!encoder.Set(bufin, bufinlen, Encoder::kMaxCanonicalLength))
+            return false;
+
+        const size_t pos = bufout.size();
+        bufout.resize(pos + sizeof(size_t) + encoder.GetCanonicalTableSize() + encoder.GetEncodedSize());
+
+        char *out = &bufout[pos];
+        memcpy(out, &bufinlen, sizeof(size_t));
 
-        bufout.append((char*)&bufinlen, sizeof(size_t));
-        encoder.WriteCodeTable(bufout);
-        encoder.Encode(bufout, bufin, bufinlen);
+        out = encoder.WriteCanonicalTable(out+sizeof(size_t));
+        encoder.Encode(out, bufin, bufinlen);
 
         return true;
     }
 
+    // Decode into memory provided by the caller, which has room for
+    // capacity symbols. The number of decoded symbols is returned in
+    // numout, the number of bytes consumed from bufin is returned.
+    // Decoder_t is Decoder or CanonicalDecoder, depending on the process.
+    template<class Decoder_t, class Output>
     inline int64_t Decode(const uint8_t *bufin,
                           size_t         bufinlen,
-                          std::vector<uint16_t> &pbufout)
+                          uint16_t      *bufout,
+                          size_t         capacity,
+                          size_t        &numout,
+                          Decoder_t     &decoder,
+                          Output        &output)
     {
         int64_t i = 0;
 
+        if (bufinlen<sizeof(size_t))
+            throw std::runtime_error("Huffman coded chunk too short to hold its number of symbols.");
+
         // Read the number of data bytes this encoding represents.
         size_t data_count = 0;
         memcpy(&data_count, bufin, sizeof(size_t));
         i += sizeof(size_t);
 
+        if (data_count>capacity)
+            throw std::runtime_error("Huffman coded chunk exceeds the size of the output buffer.");
 
-        pbufout.resize(data_count);
-
-        const Decoder decoder(bufin, i);
+        decoder.Set(bufin, i, bufin+bufinlen);
 
         const uint8_t *in_ptr =
             decoder.Decode(bufin+i, bufin+bufinlen,
-                           pbufout.data(), pbufout.data()+data_count);
+                           bufout, bufout+data_count, output);
+
+        numout = data_count;
 
         return in_ptr-bufin;
     }
 
+    template<class Decoder_t>
+    inline int64_t Decode(const uint8_t *bufin,
+                          size_t         bufinlen,
+                          uint16_t      *bufout,
+                          size_t         capacity,
+                          size_t        &numout,
+                          Decoder_t     &decoder)
+    {
+        Store store;
+        return Decode(bufin, bufinlen, bufout, capacity, numout, decoder, store);
+    }
+
+    // Decode with a decoder which is reused from call to call
+    template<class Decoder_t>
+    inline int64_t Decode(const uint8_t *bufin,
+                          size_t         bufinlen,
+                          std::vector<uint16_t> &pbufout,
+                          Decoder_t     &decoder)
+    {
+        // Read the number of data bytes this encoding represents.
+        size_t data_count = 0;
+        memcpy(&data_count, bufin, sizeof(size_t));
+
+        pbufout.resize(data_count);
+
+        return Decode(bufin, bufinlen, pbufout.data(), data_count, data_count, decoder);
+    }
+
+    inline int64_t Decode(const uint8_t *bufin,
+                          size_t         bufinlen,
+                          std::vector<uint16_t> &pbufout)
+    {
+        Decoder decoder;
+        return Decode(bufin, bufinlen, pbufout, decoder);
+    }
+
 };
 
 #endif
@@ -0,0 +1,849 @@
+/*
+ * iobackend.h
+ *
+ * Alternative sources of data for the fits readers. All of them are
+ * stream buffers, so that the readers work with them through the usual
+ * seekg/read. Backends which hold the whole file in memory also give
+ * direct access to the data, so that no copy is needed at all.
+ *
+ */
+
+#ifndef MARS_iobackend
+#define MARS_iobackend
+
+#include <zlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <future>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <streambuf>
+
+#include "threadpool.h"
+
+class IOBackend : public std::streambuf
+{
+public:
+    enum Type_t
+    {
+        kStream, ///< std::ifstream, i.e. no backend at all
+        kMmap,   ///< file mapped into memory
+        kPread,  ///< pread on a file descriptor, no shared file position
+        kMemory, ///< whole file read into memory at construction
+        kGzip    ///< gzip compressed file, inflated while reading
+    };
+
+    virtual ~IOBackend() { }
+
+    virtual bool is_open() const = 0;
+
+    // Pointer to size bytes at position pos of the file or NULL
+    // if this backend cannot provide them without copying
+    virtual const char *Map(std::streamoff /*pos*/, size_t /*size*/) const
+    {
+        return NULL;
+    }
+
+    // File descriptor to read from with pread, -1 if there is none
+    virtual int GetFileDescriptor() const
+    {
+        return -1;
+    }
+
+    // Another backend reading the same data, but with its own position
+    virtual IOBackend *Clone() const = 0;
+
+    // Create a backend of the given type reading the file fname.
+    // For kStream no backend is needed, NULL is returned.
+    static IOBackend *Create(const std::string &fname, Type_t type);
+};
+
+// Data which is already in memory. The memory is not owned.
+class MemoryBackend : public IOBackend
+{
+protected:
+    std::vector<char> fData; ///< used if the data is owned
+
+    void SetBuffer(const char *data, size_t size)
+    {
+        char *ptr = const_cast<char*>(data);
+        setg(ptr, ptr, ptr+size);
+    }
+
+    MemoryBackend() { }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+    {
+        if (!(which&std::ios_base::in))
+            return pos_type(off_type(-1));
+
+        off_type pos = off;
+        if (dir==std::ios_base::cur)
+            pos += gptr()-eback();
+        if (dir==std::ios_base::end)
+            pos += egptr()-eback();
+
+        if (pos<0 || pos>egptr()-eback())
+            return pos_type(off_type(-1));
+
+        setg(eback(), eback()+pos, egptr());
+        return pos_type(pos);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+
+    std::streamsize xsgetn(char *s, std::streamsize n)
+    {
+        if (n>egptr()-gptr())
+            n = egptr()-gptr();
+
+        memcpy(s, gptr(), n);
+        gbump(n);
+
+        return n;
+    }
+
+public:
+    MemoryBackend(const char *data, size_t size)
+    {
+        SetBuffer(data, size);
+    }
+
+    // Read the whole file into memory
+    MemoryBackend(const std::string &fname)
+    {
+        const int fd = open(fname.c_str(), O_RDONLY);
+        if (fd<0)
+            return;
+
+        struct stat st;
+        if (fstat(fd, &st)==0)
+        {
+            fData.resize(st.st_size);
+
+            size_t pos = 0;
+            while (pos<fData.size())
+            {
+                const ssize_t n = read(fd, fData.data()+pos, fData.size()-pos);
+                if (n<0 && errno==EINTR)
+                    continue;
+                if (n<=0)
+                    break;
+                pos += n;
+            }
+
+            fData.resize(pos);
+        }
+
+        close(fd);
+
+        SetBuffer(fData.data(), fData.size());
+    }
+
+    bool is_open() const { return eback()!=NULL; }
+
+    // The clone does not own the data. It must not live longer than this one.
+    IOBackend *Clone() const
+    {
+        return new MemoryBackend(eback(), egptr()-eback());
+    }
+
+    const char *Map(std::streamoff pos, size_t size) const
+    {
+        if (pos<0 || pos+off_type(size)>egptr()-eback())
+            return NULL;
+
+        return eback()+pos;
+    }
+};
+
+// File mapped into memory. The pages are read by the kernel on access.
+class MmapBackend : public MemoryBackend
+{
+    void  *fAddr;
+    size_t fSize;
+
+public:
+    MmapBackend(const std::string &fname) : fAddr(MAP_FAILED), fSize(0)
+    {
+        const int fd = open(fname.c_str(), O_RDONLY);
+        if (fd<0)
+            return;
+
+        struct stat st;
+        if (fstat(fd, &st)==0 && st.st_size>0)
+        {
+            fSize = st.st_size;
+            fAddr = mmap(NULL, fSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+
+        // The mapping keeps the file open
+        close(fd);
+
+        if (fAddr==MAP_FAILED)
+            return;
+
+        madvise(fAddr, fSize, MADV_SEQUENTIAL);
+
+        SetBuffer(reinterpret_cast<const char*>(fAddr), fSize);
+    }
+
+    ~MmapBackend()
+    {
+        if (fAddr!=MAP_FAILED)
+            munmap(fAddr, fSize);
+    }
+};
+
+// Reads with pread from a file descriptor. As no file position is
+// kept by the kernel, the descriptor could be shared.
+class PreadBackend : public IOBackend
+{
+    int fFd;
+
+    std::streamoff    fPos;    ///< position in the file of the end of the get area
+    std::vector<char> fBuffer;
+
+    // Read from the file at fPos, retrying on interrupts
+    ssize_t Read(char *dest, size_t size)
+    {
+        while (1)
+        {
+            const ssize_t n = pread(fFd, dest, size, fPos);
+            if (n<0 && errno==EINTR)
+                continue;
+
+            if (n>0)
+                fPos += n;
+
+            return n;
+        }
+    }
+
+protected:
+    int_type underflow()
+    {
+        if (gptr()<egptr())
+            return traits_type::to_int_type(*gptr());
+
+        const ssize_t n = Read(fBuffer.data(), fBuffer.size());
+        if (n<=0)
+            return traits_type::eof();
+
+        setg(fBuffer.data(), fBuffer.data(), fBuffer.data()+n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize xsgetn(char *s, std::streamsize n)
+    {
+        // Whatever is still buffered
+        std::streamsize done = std::min<std::streamsize>(n, egptr()-gptr());
+
+        memcpy(s, gptr(), done);
+        gbump(done);
+
+        if (done==n)
+            return done;
+
+        // The buffer is used up, start over at the current position
+        setg(fBuffer.data(), fBuffer.data(), fBuffer.data());
+
+        // Large reads go directly to the destination
+        while (n-done>=std::streamsize(fBuffer.size()))
+        {
+            const ssize_t r = Read(s+done, n-done);
+            if (r<=0)
+                return done;
+
+            done += r;
+        }
+
+        // The rest through the buffer
+        while (done<n)
+        {
+            if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+                return done;
+
+            const std::streamsize r = std::min<std::streamsize>(n-done, egptr()-gptr());
+
+            memcpy(s+done, gptr(), r);
+            gbump(r);
+
+            done += r;
+        }
+
+        return done;
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+    {
+        if (!(which&std::ios_base::in) || fFd<0)
+            return pos_type(off_type(-1));
+
+        // position in the file of the start of the get area
+        const std::streamoff start = fPos - (egptr()-eback());
+
+        off_type pos = off;
+        if (dir==std::ios_base::cur)
+            pos += fPos - (egptr()-gptr());
+        if (dir==std::ios_base::end)
+        {
+            struct stat st;
+            if (fstat(fFd, &st)!=0)
+                return pos_type(off_type(-1));
+
+            pos += st.st_size;
+        }
+
+        if (pos<0)
+            return pos_type(off_type(-1));
+
+        // Keep the buffer if the new position is inside
+        if (pos>=start && pos<=fPos)
+            setg(eback(), eback()+(pos-start), egptr());
+        else
+        {
+            setg(fBuffer.data(), fBuffer.data(), fBuffer.data());
+            fPos = pos;
+        }
+
+        return pos_type(pos);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+
+public:
+    PreadBackend(const std::string &fname, size_t bufferSize=1<<16) : fPos(0), fBuffer(bufferSize)
+    {
+        fFd = open(fname.c_str(), O_RDONLY);
+        setg(fBuffer.data(), fBuffer.data(), fBuffer.data());
+    }
+
+    // Takes ownership of the file descriptor
+    PreadBackend(int fd, size_t bufferSize=1<<16) : fFd(fd), fPos(0), fBuffer(bufferSize)
+    {
+        setg(fBuffer.data(), fBuffer.data(), fBuffer.data());
+    }
+
+    ~PreadBackend()
+    {
+        if (fFd>=0)
+            close(fFd);
+    }
+
+    bool is_open() const { return fFd>=0; }
+
+    int GetFileDescriptor() const { return fFd; }
+
+    IOBackend *Clone() const
+    {
+        return new PreadBackend(fFd<0 ? -1 : dup(fFd), fBuffer.size());
+    }
+};
+
+// Reads a gzip compressed file. While inflating, the state of the
+// decompression is stored every span bytes at the start of a deflate
+// block (like zran.c from zlib), so that a seek only has to inflate
+// from the closest checkpoint. The checkpoints are shared with all
+// clones. During sequential access the next chunk is inflated by a
+// background thread while the current one is read.
+class GzipBackend : public IOBackend
+{
+public:
+    enum
+    {
+        kChunkSize  = 1<<18, ///< uncompressed bytes inflated at once
+        kInputSize  = 1<<16, ///< compressed bytes read at once
+        kWindowSize = 1<<15  ///< history needed to restart inflating
+    };
+
+private:
+    // State of the decompression at the start of a deflate block
+    struct Point
+    {
+        std::streamoff out;   ///< position in the uncompressed data
+        std::streamoff in;    ///< position in the file of the first complete byte of the block
+        int            bits;  ///< number of bits of the previous byte which belong to the block
+
+        std::vector<unsigned char> window; ///< uncompressed data preceding out
+    };
+
+    // Checkpoints shared by all clones
+    struct Index
+    {
+        std::mutex         mutex;
+        std::vector<Point> points; ///< ordered by position
+        std::streamoff     span;   ///< minimum distance between two points
+        std::streamoff     size;   ///< uncompressed size, -1 until the end was reached
+
+        Index(std::streamoff s) : span(s), size(-1) { }
+    };
+
+    struct Chunk
+    {
+        std::vector<char> data;
+        std::streamoff    pos;  ///< position of data[0] in the uncompressed data
+        size_t            size; ///< number of valid bytes
+
+        Chunk() : data(kChunkSize), pos(0), size(0) { }
+    };
+
+    int fFd;
+
+    std::shared_ptr<Index> fIndex;
+
+    z_stream fStream;
+    bool     fInit;  ///< fStream was initialized successfully
+    bool     fRaw;   ///< inflating raw deflate data, started at a checkpoint
+    bool     fEnd;   ///< no more data can be inflated
+
+    std::streamoff fIn;  ///< position in the file of the next compressed byte to read
+    std::streamoff fOut; ///< position of the next inflated byte
+
+    std::vector<unsigned char> fInput;
+
+    Chunk          fCur;  ///< the get area
+    Chunk          fNext; ///< inflated ahead
+    std::streamoff fSeek; ///< position of a seek not yet carried out, -1 if none
+
+    std::future<void>  fAhead;    ///< inflating the next chunk in the background
+    std::streamoff     fAheadPos; ///< where the next chunk starts
+    std::atomic<bool>  fCancel;   ///< stop inflating ahead
+    ThreadPool         fThread;
+
+    // Read more compressed data, keeping what was not yet used
+    bool Read()
+    {
+        if (fStream.avail_in>0)
+            memmove(fInput.data(), fStream.next_in, fStream.avail_in);
+
+        fStream.next_in = fInput.data();
+
+        while (1)
+        {
+            const ssize_t n = pread(fFd, fInput.data()+fStream.avail_in, fInput.size()-fStream.avail_in, fIn);
+            if (n<0 && errno==EINTR)
+                continue;
+            if (n<=0)
+                return false;
+
+            fIn += n;
+            fStream.avail_in += n;
+
+            return true;
+        }
+    }
+
+    // Make sure that at least n compressed bytes are available
+    bool Need(size_t n)
+    {
+        while (fStream.avail_in<n)
+            if (!Read())
+                return false;
+        return true;
+    }
+
+    // Store a checkpoint if the last one is far enough away
+    void AddPoint()
+    {
+        std::lock_guard<std::mutex> lock(fIndex->mutex);
+
+        std::vector<Point> &points = fIndex->points;
+        if (!points.empty() && fOut<points.back().out+fIndex->span)
+            return;
+
+        Point p;
+        p.out  = fOut;
+        p.in   = fIn - fStream.avail_in;
+        p.bits = fStream.data_type & 7;
+
+        uInt len = kWindowSize;
+        p.window.resize(len);
+        inflateGetDictionary(&fStream, p.window.data(), &len);
+        p.window.resize(len);
+
+        points.emplace_back(std::move(p));
+    }
+
+    // A gzip member is complete, another one might follow
+    void EndOfMember()
+    {
+        // A raw inflate does not read the trailer with crc and size
+        if (fRaw)
+        {
+            if (!Need(8))
+            {
+                fEnd = true;
+                return;
+            }
+
+            fStream.next_in  += 8;
+            fStream.avail_in -= 8;
+        }
+
+        if (!Need(2) || fStream.next_in[0]!=0x1f || fStream.next_in[1]!=0x8b)
+        {
+            fEnd = true;
+            return;
+        }
+
+        inflateReset2(&fStream, 31);
+        fRaw = false;
+    }
+
+    // Inflate up to size bytes to dest
+    size_t Inflate(char *dest, size_t size)
+    {
+        fStream.next_out  = reinterpret_cast<Bytef*>(dest);
+        fStream.avail_out = size;
+
+        while (fStream.avail_out>0 && !fEnd && !fCancel)
+        {
+            if (fStream.avail_in==0 && !Read())
+            {
+                // The file is truncated
+                fEnd = true;
+                break;
+            }
+
+            const uInt avail = fStream.avail_out;
+
+            const int rc = inflate(&fStream, Z_BLOCK);
+
+            fOut += avail - fStream.avail_out;
+
+            if (rc==Z_STREAM_END)
+            {
+                EndOfMember();
+                continue;
+            }
+
+            if (rc!=Z_OK && rc!=Z_BUF_ERROR)
+            {
+                // Corrupted data is treated like the end of the file
+                fEnd = true;
+                break;
+            }
+
+            // At the end of a block which is not the last one
+            if ((fStream.data_type&128) && !(fStream.data_type&64))
+                AddPoint();
+        }
+
+        if (fEnd)
+        {
+            std::lock_guard<std::mutex> lock(fIndex->mutex);
+            fIndex->size = fOut;
+        }
+
+        return size - fStream.avail_out;
+    }
+
+    void Fill(Chunk &chunk)
+    {
+        chunk.pos  = fOut;
+        chunk.size = Inflate(chunk.data.data(), chunk.data.size());
+    }
+
+    // Restart at the beginning of the file
+    void Restart()
+    {
+        inflateReset2(&fStream, 31);
+
+        fStream.avail_in = 0;
+
+        fIn  = 0;
+        fOut = 0;
+        fRaw = false;
+        fEnd = false;
+    }
+
+    // Restart at a checkpoint
+    bool Restart(const Point &p)
+    {
+        inflateReset2(&fStream, -15);
+
+        fStream.avail_in = 0;
+
+        fIn  = p.in - (p.bits ? 1 : 0);
+        fOut = p.out;
+        fRaw = true;
+        fEnd = false;
+
+        if (p.bits)
+        {
+            if (!Need(1))
+                return false;
+
+            const int byte = *fStream.next_in++;
+            fStream.avail_in--;
+
+            inflatePrime(&fStream, p.bits, byte>>(8-p.bits));
+        }
+
+        inflateSetDictionary(&fStream, p.window.data(), p.window.size());
+
+        return true;
+    }
+
+    // Bring the decompression to pos, from a checkpoint if that is closer
+    bool Position(std::streamoff pos)
+    {
+        Point p;
+        p.out = -1;
+
+        {
+            std::lock_guard<std::mutex> lock(fIndex->mutex);
+
+            const std::vector<Point> &points = fIndex->points;
+
+            auto it = std::upper_bound(points.begin(), points.end(), pos,
+                                       [](std::streamoff v, const Point &pt) { return v<pt.out; });
+
+            if (it!=points.begin() && (pos<fOut || (it-1)->out>fOut))
+                p = *(it-1);
+        }
+
+        if (p.out>=0)
+        {
+            if (!Restart(p))
+                return false;
+        }
+        else
+            if (pos<fOut)
+                Restart();
+
+        // The skipped data is inflated to the spare chunk
+        fNext.size = 0;
+        while (fOut<pos && !fEnd)
+            Inflate(fNext.data.data(), std::min<std::streamoff>(pos-fOut, fNext.data.size()));
+
+        return fOut==pos;
+    }
+
+    // Wait for the background thread
+    void Wait()
+    {
+        if (fAhead.valid())
+            fAhead.get();
+    }
+
+    // Make the chunk containing pos the get area
+    bool Load(std::streamoff pos)
+    {
+        // Inflating ahead is useless if the data is not needed
+        if (fAhead.valid() && (pos<fAheadPos || pos>=fAheadPos+kChunkSize))
+            fCancel = true;
+
+        Wait();
+
+        fCancel = false;
+
+        if (pos>=fNext.pos && pos<fNext.pos+std::streamoff(fNext.size))
+            std::swap(fCur, fNext);
+        else
+            if (pos<fCur.pos || pos>=fCur.pos+std::streamoff(fCur.size))
+            {
+                if (!Position(pos))
+                    return false;
+
+                Fill(fCur);
+                if (fCur.size==0)
+                    return false;
+            }
+
+        setg(fCur.data.data(), fCur.data.data()+(pos-fCur.pos), fCur.data.data()+fCur.size);
+
+        // Inflate the next chunk while this one is read
+        if (!fEnd && fOut==fCur.pos+std::streamoff(fCur.size))
+        {
+            fAheadPos = fOut;
+            fAhead    = fThread.Submit([this]() { Fill(fNext); });
+        }
+
+        return true;
+    }
+
+    std::streamoff Tell() const
+    {
+        return fSeek>=0 ? fSeek : fCur.pos + (gptr()-eback());
+    }
+
+    // Uncompressed size, the whole file is inflated if not yet known
+    std::streamoff GetSize()
+    {
+        {
+            std::lock_guard<std::mutex> lock(fIndex->mutex);
+            if (fIndex->size>=0)
+                return fIndex->size;
+        }
+
+        fCancel = true;
+        Wait();
+        fCancel = false;
+
+        fNext.size = 0;
+        while (!fEnd)
+            Inflate(fNext.data.data(), fNext.data.size());
+
+        return fOut;
+    }
+
+    void Init()
+    {
+        memset(&fStream, 0, sizeof(z_stream));
+        fInit = fFd>=0 && inflateInit2(&fStream, 31)==Z_OK;
+
+        fRaw = false;
+        fEnd = false;
+        fIn  = 0;
+        fOut = 0;
+
+        fSeek     = -1;
+        fAheadPos = 0;
+        fCancel   = false;
+
+        char *ptr = fCur.data.data();
+        setg(ptr, ptr, ptr);
+
+        // Only gzip compressed files are accepted
+        unsigned char magic[2];
+        if (fInit && (pread(fFd, magic, 2, 0)!=2 || magic[0]!=0x1f || magic[1]!=0x8b))
+        {
+            inflateEnd(&fStream);
+            fInit = false;
+        }
+
+        fThread.Start(1);
+    }
+
+protected:
+    int_type underflow()
+    {
+        if (gptr()<egptr())
+            return traits_type::to_int_type(*gptr());
+
+        const std::streamoff pos = fSeek>=0 ? fSeek : fCur.pos+fCur.size;
+
+        fSeek = -1;
+
+        if (!fInit || !Load(pos))
+        {
+            // Keep the position for tellg
+            char *ptr = fCur.data.data();
+            setg(ptr, ptr, ptr);
+
+            fSeek = pos;
+            return traits_type::eof();
+        }
+
+        return traits_type::to_int_type(*gptr());
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+    {
+        if (!(which&std::ios_base::in) || !fInit)
+            return pos_type(off_type(-1));
+
+        off_type pos = off;
+        if (dir==std::ios_base::cur)
+            pos += Tell();
+        if (dir==std::ios_base::end)
+            pos += GetSize();
+
+        if (pos<0)
+            return pos_type(off_type(-1));
+
+        // Keep the current chunk if the new position is inside, even if
+        // the get area was emptied by a seek outside. Otherwise the data
+        // is inflated when it is read.
+        if (pos>=fCur.pos && pos<fCur.pos+std::streamoff(fCur.size))
+        {
+            char *ptr = fCur.data.data();
+            setg(ptr, ptr+(pos-fCur.pos), ptr+fCur.size);
+            fSeek = -1;
+        }
+        else
+        {
+            setg(eback(), eback(), eback());
+            fSeek = pos;
+        }
+
+        return pos_type(pos);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which)
+    {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+
+    // Takes ownership of the file descriptor
+    GzipBackend(int fd, const std::shared_ptr<Index> &index) :
+        fFd(fd), fIndex(index), fInput(kInputSize)
+    {
+        Init();
+    }
+
+public:
+    // A checkpoint is stored about every span bytes of uncompressed data
+    GzipBackend(const std::string &fname, std::streamoff span=1<<20) :
+        fFd(open(fname.c_str(), O_RDONLY)), fIndex(std::make_shared<Index>(span)), fInput(kInputSize)
+    {
+        Init();
+    }
+
+    ~GzipBackend()
+    {
+        fCancel = true;
+        fThread.Stop();
+
+        if (fInit)
+            inflateEnd(&fStream);
+        if (fFd>=0)
+            close(fFd);
+    }
+
+    bool is_open() const { return fInit; }
+
+    // The clone shares the checkpoints
+    IOBackend *Clone() const
+    {
+        return new GzipBackend(fFd<0 ? -1 : dup(fFd), fIndex);
+    }
+
+    // Number of checkpoints stored so far
+    size_t GetNumPoints() const
+    {
+        std::lock_guard<std::mutex> lock(fIndex->mutex);
+        return fIndex->points.size();
+    }
+};
+
+inline IOBackend *IOBackend::Create(const std::string &fname, Type_t type)
+{
+    switch (type)
+    {
+    case kMmap:   return new MmapBackend(fname);
+    case kPread:  return new PreadBackend(fname);
+    case kMemory: return new MemoryBackend(fname);
+    case kGzip:   return new GzipBackend(fname);
+    default:      return NULL;
+    }
+}
+
+#endif
@@ -0,0 +1,594 @@
+#ifndef FACT_tans
+#define FACT_tans
+
+// Table based asymmetric numeral systems (tANS) coding of 16 bit
+// symbols, the process kFactTANS16. A chunk is framed like a Huffman
+// coded one (see huffman.h): the number of symbols, the code table and
+// the encoded data. The table holds the symbols and their counts
+// normalized to the size of the state table. The encoded data starts
+// with the initial states of two interleaved decoders, the even symbols
+// are decoded by the first, the odd ones by the second.
+
+#include <math.h>
+#include <functional>
+
+#include "huffman.h"
+
+namespace TANS
+{
+    enum
+    {
+        kMinTableLog = 5,  ///< the spreading of the symbols needs at least 32 states
+        kMaxTableLog = 15
+    };
+
+    inline uint32_t HighBit(uint32_t v)
+    {
+        uint32_t n = 0;
+        while (v>>=1)
+            n++;
+        return n;
+    }
+
+    // Variable length integers: seven bits per byte, the highest bit is
+    // set if another byte follows
+    inline char *WriteVarInt(char *out, uint32_t v)
+    {
+        while (v>=0x80)
+        {
+            *out++ = (v&0x7f)|0x80;
+            v >>= 7;
+        }
+        *out++ = v;
+        return out;
+    }
+
+    inline uint32_t GetVarIntSize(uint32_t v)
+    {
+        uint32_t n = 1;
+        while (v>=0x80)
+        {
+            v >>= 7;
+            n++;
+        }
+        return n;
+    }
+
+    // Read a number from [in, in_end)
+    inline const uint8_t *ReadVarInt(const uint8_t *in, const uint8_t *in_end, uint32_t &v)
+    {
+        v = 0;
+        for (int shift=0; ; shift+=7)
+        {
+            if (shift>28)
+                throw std::runtime_error("Invalid number in tANS code table.");
+
+            if (in==in_end)
+                throw std::runtime_error("tANS code table exceeds the coded chunk.");
+
+            v |= uint32_t(*in&0x7f) << shift;
+            if ((*in++&0x80)==0)
+                return in;
+        }
+    }
+
+    // Distribute the symbols over the states. The step is odd, so all
+    // states are visited once.
+    template<class T>
+    void Spread(std::vector<T> &spread, const std::vector<uint32_t> &norm, uint32_t tableLog)
+    {
+        const uint32_t size = 1<<tableLog;
+        const uint32_t mask = size-1;
+        const uint32_t step = (size>>1) + (size>>3) + 3;
+
+        spread.resize(size);
+
+        uint32_t pos = 0;
+        for (uint32_t s=0; s<norm.size(); s++)
+            for (uint32_t i=0; i<norm[s]; i++)
+            {
+                spread[pos] = s;
+                pos = (pos+step)&mask;
+            }
+    }
+
+    // Like Huffman::Encoder, meant to be reused from chunk to chunk
+    struct Encoder
+    {
+        struct Transform
+        {
+            int32_t deltaNbBits;    ///< number of bits to output is (state+deltaNbBits)>>16
+            int32_t deltaFindState; ///< offset of the symbol's states in the state table
+        };
+
+        std::vector<uint32_t> fCounts;     ///< occurrences of each symbol, all zero between chunks
+        std::vector<uint16_t> fIndex;      ///< index of each symbol of the chunk in fSymbols
+        std::vector<uint16_t> fSymbols;    ///< symbols of the chunk, ascending
+        std::vector<uint32_t> fNorm;       ///< normalized count of each symbol in fSymbols
+        std::vector<uint32_t> fOrder;      ///< scratch for the normalization
+        std::vector<std::pair<double, uint32_t>> fLoss; ///< heap of the bits lost by taking a state from a symbol
+        std::vector<uint16_t> fSpread;     ///< symbol index of each state
+        std::vector<uint16_t> fStateTable; ///< states of each symbol, ordered by symbol
+        std::vector<Transform> fTransform; ///< of each symbol index
+        std::vector<uint32_t> fRecords;    ///< bits written for each symbol: value<<8 | number of bits
+
+        uint32_t fTableLog; ///< 0 if the chunk has at most one different symbol
+
+        // Scale the counts to a sum of 2^fTableLog, none below one
+        void Normalize(size_t bufinlen)
+        {
+            const uint32_t size = 1<<fTableLog;
+            const size_t   n    = fSymbols.size();
+
+            fNorm.resize(n);
+
+            uint32_t sum = 0;
+            for (size_t i=0; i<n; i++)
+            {
+                const uint64_t c = fCounts[fSymbols[i]];
+                fNorm[i] = std::max<uint64_t>(c*size/bufinlen, 1);
+                sum += fNorm[i];
+            }
+
+            fOrder.resize(n);
+            for (size_t i=0; i<n; i++)
+                fOrder[i] = i;
+
+            const std::vector<uint32_t> &norm   = fNorm;
+            const std::vector<uint32_t> &counts = fCounts;
+            const std::vector<uint16_t> &syms   = fSymbols;
+
+            // Rounded down: the states left go to the largest remainders
+            if (sum<size)
+            {
+                const auto remainder = [&](uint32_t i) { return int64_t(counts[syms[i]])*size - int64_t(norm[i])*bufinlen; };
+                std::sort(fOrder.begin(), fOrder.end(), [&](uint32_t a, uint32_t b) { return remainder(a)>remainder(b); });
+
+                for (size_t i=0; sum<size; i=(i+1)%n, sum++)
+                    fNorm[fOrder[i]]++;
+            }
+
+            // Raised to one: take the states from the symbols which lose
+            // the least bits by it
+            if (sum>size)
+            {
+                fLoss.clear();
+                for (size_t i=0; i<n; i++)
+                    if (fNorm[i]>1)
+                        fLoss.emplace_back(counts[syms[i]]*log2(fNorm[i]/(fNorm[i]-1.)), i);
+
+                std::make_heap(fLoss.begin(), fLoss.end(), std::greater<std::pair<double, uint32_t>>());
+
+                for (; sum>size; sum--)
+                {
+                    std::pop_heap(fLoss.begin(), fLoss.end(), std::greater<std::pair<double, uint32_t>>());
+
+                    const uint32_t i = fLoss.back().second;
+                    fLoss.pop_back();
+
+                    if (--fNorm[i]>1)
+                    {
+                        fLoss.emplace_back(counts[syms[i]]*log2(fNorm[i]/(fNorm[i]-1.)), i);
+                        std::push_heap(fLoss.begin(), fLoss.end(), std::greater<std::pair<double, uint32_t>>());
+                    }
+                }
+            }
+        }
+
+        void BuildTables()
+        {
+            const uint32_t size = 1<<fTableLog;
+            const size_t   n    = fSymbols.size();
+
+            Spread(fSpread, fNorm, fTableLog);
+
+            std::vector<uint32_t> &cumul = fOrder;
+            cumul.resize(n);
+
+            uint32_t total = 0;
+            for (size_t i=0; i<n; i++)
+            {
+                cumul[i] = total;
+                total += fNorm[i];
+            }
+
+            fStateTable.resize(size);
+            for (uint32_t u=0; u<size; u++)
+                fStateTable[cumul[fSpread[u]]++] = size+u;
+
+            fTransform.resize(n);
+
+            total = 0;
+            for (size_t i=0; i<n; i++)
+            {
+                Transform &t = fTransform[i];
+
+                if (fNorm[i]==1)
+                {
+                    t.deltaNbBits    = (fTableLog<<16) - size;
+                    t.deltaFindState = total - 1;
+                }
+                else
+                {
+                    const uint32_t maxBitsOut   = fTableLog - HighBit(fNorm[i]-1);
+                    const uint32_t minStatePlus = fNorm[i] << maxBitsOut;
+
+                    t.deltaNbBits    = (maxBitsOut<<16) - minStatePlus;
+                    t.deltaFindState = total - fNorm[i];
+                }
+
+                total += fNorm[i];
+            }
+        }
+
+        // Build the tables for the chunk [bufin, bufin+bufinlen). False if
+        // it has more different symbols than states can be afforded.
+        bool Set(const uint16_t *bufin, size_t bufinlen)
+        {
+            fSymbols.clear();
+
+            for (const uint16_t *p=bufin; p<bufin+bufinlen; p++)
+                if (fCounts[*p]++==0)
+                    fSymbols.push_back(*p);
+
+            std::sort(fSymbols.begin(), fSymbols.end());
+
+            const size_t n = fSymbols.size();
+
+            fTableLog = 0;
+
+            if (n>1 && n<=(1U<<kMaxTableLog))
+            {
+                // Enough states for the resolution the chunk allows and
+                // room for the rare symbols
+                fTableLog = std::min<uint32_t>(HighBit(bufinlen-1)+1, 13);
+                fTableLog = std::max<uint32_t>(fTableLog, HighBit(n-1)+2);
+                fTableLog = std::max<uint32_t>(fTableLog, kMinTableLog);
+                fTableLog = std::min<uint32_t>(fTableLog, kMaxTableLog);
+
+                for (size_t i=0; i<n; i++)
+                    fIndex[fSymbols[i]] = i;
+
+                Normalize(bufinlen);
+                BuildTables();
+            }
+
+            for (auto it=fSymbols.cbegin(); it!=fSymbols.cend(); it++)
+                fCounts[*it] = 0;
+
+            return n<=(1U<<kMaxTableLog);
+        }
+
+        // The code table: the table log (0 if there is only one symbol,
+        // which follows then), the number of symbols, the differences
+        // between consecutive symbols and the normalized counts minus one
+        size_t GetCodeTableSize() const
+        {
+            if (fTableLog==0)
+                return sizeof(uint8_t)+sizeof(uint16_t);
+
+            size_t size = sizeof(uint8_t)+sizeof(uint16_t);
+
+            uint32_t prev = 0;
+            for (size_t i=0; i<fSymbols.size(); i++)
+            {
+                size += GetVarIntSize(fSymbols[i]-prev) + GetVarIntSize(fNorm[i]-1);
+                prev = fSymbols[i];
+            }
+
+            return size;
+        }
+
+        char *WriteCodeTable(char *out) const
+        {
+            *out++ = fTableLog;
+
+            if (fTableLog==0)
+            {
+                const uint16_t symbol = fSymbols.empty() ? 0 : fSymbols[0];
+                memcpy(out, &symbol, sizeof(uint16_t));
+                return out+sizeof(uint16_t);
+            }
+
+            // Up to 2^15 symbols, stored minus one
+            const uint16_t n = fSymbols.size()-1;
+            memcpy(out, &n, sizeof(uint16_t));
+            out += sizeof(uint16_t);
+
+            uint32_t prev = 0;
+            for (auto it=fSymbols.cbegin(); it!=fSymbols.cend(); it++)
+            {
+                out = WriteVarInt(out, *it-prev);
+                prev = *it;
+            }
+
+            for (auto it=fNorm.cbegin(); it!=fNorm.cend(); it++)
+                out = WriteVarInt(out, *it-1);
+
+            return out;
+        }
+
+        // Append the initial states and the bits of the chunk to out.
+        // The symbols are encoded backwards, the bits of each symbol are
+        // kept and written forwards, in the order the decoder reads them.
+        void Encode(std::string &out, const uint16_t *bufin, size_t bufinlen)
+        {
+            if (fTableLog==0)
+                return;
+
+            const uint32_t size = 1<<fTableLog;
+
+            fRecords.resize(bufinlen);
+
+            uint32_t state[2] = { size, size };
+            uint64_t numbits  = 0;
+
+            for (size_t i=bufinlen; i-->0; )
+            {
+                const Transform &t = fTransform[fIndex[bufin[i]]];
+
+                uint32_t &x = state[i&1];
+
+                const uint32_t nb = (x + t.deltaNbBits) >> 16;
+
+                fRecords[i] = ((x & ((1<<nb)-1)) << 8) | nb;
+                numbits += nb;
+
+                x = fStateTable[(x>>nb) + t.deltaFindState];
+            }
+
+            const size_t pos = out.size();
+            out.resize(pos + 2*sizeof(uint16_t) + Huffman::numbytes_from_numbits(numbits));
+
+            char *ptr = &out[pos];
+
+            for (int k=0; k<2; k++)
+            {
+                const uint16_t s = state[k]-size;
+                memcpy(ptr, &s, sizeof(uint16_t));
+                ptr += sizeof(uint16_t);
+            }
+
+            uint64_t bitbuf = 0;
+            uint32_t nbits  = 0;
+
+            for (auto it=fRecords.cbegin(); it!=fRecords.cend(); it++)
+            {
+                bitbuf |= uint64_t(*it>>8) << nbits;
+                nbits  += *it&0xff;
+
+                if (nbits>=32)
+                {
+                    const uint32_t word = bitbuf;
+                    memcpy(ptr, &word, sizeof(uint32_t));
+                    ptr += sizeof(uint32_t);
+
+                    bitbuf >>= 32;
+                    nbits   -= 32;
+                }
+            }
+
+            for (; nbits>0; nbits -= std::min<uint32_t>(nbits, 8), bitbuf >>= 8)
+                *ptr++ = bitbuf&0xff;
+        }
+
+        Encoder() : fCounts(MAX_SYMBOLS), fIndex(MAX_SYMBOLS), fTableLog(0)
+        {
+        }
+    };
+
+    // Can be used wherever a Huffman::Decoder is, see Huffman::Decode
+    struct Decoder
+    {
+        struct Entry
+        {
+            uint16_t base;    ///< next state without the bits read
+            uint16_t symbol;
+            uint8_t  numbits; ///< bits read for the next state
+        };
+
+        std::vector<Entry>    fTable;     ///< one entry per state
+        std::vector<uint8_t>  fCodeTable; ///< serialized code table the table was built from
+        std::vector<uint32_t> fNorm;      ///< normalized counts while the table is built
+        std::vector<uint16_t> fSymbols;   ///< symbols while the table is built
+        std::vector<uint16_t> fSpread;    ///< symbol index of each state while the table is built
+
+        uint32_t fTableLog;
+        bool     fOneSymbol; ///< only one symbol in the stream, no bits encoded
+        uint16_t fSymbol;    ///< the one symbol if fOneSymbol
+
+        // Size in bytes of the serialized code table at bufin, which
+        // must end before in_end
+        static size_t GetCodeTableSize(const uint8_t *bufin, const uint8_t *in_end)
+        {
+            if (size_t(in_end-bufin)<sizeof(uint8_t)+sizeof(uint16_t))
+                throw std::runtime_error("tANS code table exceeds the coded chunk.");
+
+            if (bufin[0]==0)
+                return sizeof(uint8_t)+sizeof(uint16_t);
+
+            uint16_t n;
+            memcpy(&n, bufin+sizeof(uint8_t), sizeof(uint16_t));
+
+            const uint8_t *ptr = bufin+sizeof(uint8_t)+sizeof(uint16_t);
+            for (uint32_t i=0; i<2*(uint32_t(n)+1); i++)
+            {
+                do
+                {
+                    if (ptr==in_end)
+                        throw std::runtime_error("tANS code table exceeds the coded chunk.");
+                }
+                while (*ptr++&0x80);
+            }
+
+            return ptr-bufin;
+        }
+
+        // Read the code table at bufin+pindex, which must end before in_end,
+        // and build the decoding table. If the table is identical to the
+        // previous one, it is kept.
+        void Set(const uint8_t* bufin, int64_t &pindex, const uint8_t *in_end)
+        {
+            const uint8_t *table = bufin + pindex;
+            const size_t   size  = GetCodeTableSize(table, in_end);
+
+            pindex += size;
+
+            if (size==fCodeTable.size() && memcmp(table, fCodeTable.data(), size)==0)
+                return;
+
+            // In case of an exception, this table has to be rebuilt next time
+            fCodeTable.clear();
+
+            fTableLog  = table[0];
+            fOneSymbol = fTableLog==0;
+
+            if (fOneSymbol)
+            {
+                memcpy(&fSymbol, table+sizeof(uint8_t), sizeof(uint16_t));
+                fCodeTable.assign(table, table+size);
+                return;
+            }
+
+            if (fTableLog<kMinTableLog || fTableLog>kMaxTableLog)
+                throw std::runtime_error("Invalid size of tANS state table.");
+
+            uint16_t n;
+            memcpy(&n, table+sizeof(uint8_t), sizeof(uint16_t));
+
+            const uint32_t numSymbols = uint32_t(n)+1;
+            const uint32_t states     = 1<<fTableLog;
+
+            fSymbols.resize(numSymbols);
+            fNorm.resize(numSymbols);
+
+            const uint8_t *ptr = table+sizeof(uint8_t)+sizeof(uint16_t);
+
+            uint32_t symbol = 0;
+            for (uint32_t i=0; i<numSymbols; i++)
+            {
+                uint32_t delta;
+                ptr = ReadVarInt(ptr, table+size, delta);
+                symbol += delta;
+                fSymbols[i] = symbol;
+            }
+
+            uint64_t total = 0;
+            for (uint32_t i=0; i<numSymbols; i++)
+            {
+                ptr = ReadVarInt(ptr, table+size, fNorm[i]);
+                fNorm[i]++;
+                total += fNorm[i];
+            }
+
+            if (symbol>0xffff || total!=states)
+                throw std::runtime_error("Invalid tANS code table.");
+
+            Spread(fSpread, fNorm, fTableLog);
+
+            // The states of a symbol are numbered from its count upwards
+            fTable.resize(states);
+            for (uint32_t u=0; u<states; u++)
+            {
+                const uint32_t s = fSpread[u];
+                const uint32_t x = fNorm[s]++;
+
+                Entry &e = fTable[u];
+                e.symbol  = fSymbols[s];
+                e.numbits = fTableLog - HighBit(x);
+                e.base    = (x << e.numbits) - states;
+            }
+
+            fCodeTable.assign(table, table+size);
+        }
+
+        // Decode the stream [in_ptr, in_end) into [out_ptr, out_end).
+        // The symbols are written by output, see Huffman::Store.
+        template<class Output>
+        const uint8_t *Decode(const uint8_t *in_ptr, const uint8_t *in_end,
+                              uint16_t *out_ptr, const uint16_t *out_end,
+                              Output &output) const
+        {
+            if (fOneSymbol)
+            {
+                while (out_ptr < out_end)
+                    output(out_ptr++, fSymbol);
+                return in_ptr;
+            }
+
+            if (in_end-in_ptr < int64_t(2*sizeof(uint16_t)))
+                throw std::runtime_error("Unexpected end of bit stream!");
+
+            uint16_t state[2];
+            memcpy(state, in_ptr, 2*sizeof(uint16_t));
+            in_ptr += 2*sizeof(uint16_t);
+
+            if (state[0]>=fTable.size() || state[1]>=fTable.size())
+                throw std::runtime_error("Invalid initial tANS state.");
+
+            const uint8_t *in_start = in_ptr;
+
+            const Entry *table = fTable.data();
+
+            uint64_t bitbuf = 0;
+            int32_t  avail  = 0;
+
+            const uint32_t perRefill = 56/fTableLog;
+
+            uint32_t w = 0;
+            while (out_ptr<out_end)
+            {
+                if (avail<0)
+                    throw std::runtime_error("Unexpected end of bit stream!");
+
+                Huffman::Decoder::Refill(in_ptr, in_end, bitbuf, avail);
+
+                // The 56 bits of a refill hold the bits of several symbols
+                for (uint32_t k=0; k<perRefill && out_ptr<out_end; k++, w^=1)
+                {
+                    const Entry &e = table[state[w]];
+
+                    output(out_ptr++, e.symbol);
+
+                    state[w] = e.base + (bitbuf & ((1U<<e.numbits)-1));
+
+                    bitbuf >>= e.numbits;
+                    avail   -= e.numbits;
+                }
+            }
+
+            if (avail<0)
+                throw std::runtime_error("Unexpected end of bit stream!");
+
+            // Bytes of which at least one bit was consumed
+            const int64_t numbits = (in_ptr-in_start)*8 - avail;
+            return in_start + Huffman::numbytes_from_numbits(numbits);
+        }
+
+        Decoder() : fTableLog(0), fOneSymbol(false), fSymbol(0)
+        {
+        }
+    };
+
+    // Append a chunk to bufout. False if the chunk has more different
+    // symbols than fit into the largest state table, nothing is
+    // appended then.
+    inline bool Encode(std::string &bufout, const uint16_t *bufin, size_t bufinlen, Encoder &encoder)
+    {
+        if (!encoder.Set(bufin, bufinlen))
+            return false;
+
+        const size_t pos = bufout.size();
+        bufout.resize(pos + sizeof(size_t) + encoder.GetCodeTableSize());
+
+        char *out = &bufout[pos];
+        memcpy(out, &bufinlen, sizeof(size_t));
+        encoder.WriteCodeTable(out+sizeof(size_t));
+
+        encoder.Encode(bufout, bufin, bufinlen);
+
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * threadpool.h
+ *
+ * Minimal pool of worker threads used by the readers to run
+ * decompression jobs in the background
+ *
+ */
+
+#ifndef MARS_threadpool
+#define MARS_threadpool
+
+#include <deque>
+#include <future>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+class ThreadPool
+{
+    std::vector<std::thread>          fThreads; ///< the workers
+    std::deque<std::function<void()>> fJobs;    ///< jobs not yet picked up by a worker
+
+    std::mutex              fMutex;
+    std::condition_variable fCond;
+
+    bool fStop; ///< tells the workers to return
+
+    void Loop()
+    {
+        while (1)
+        {
+            std::function<void()> job;
+
+            {
+                std::unique_lock<std::mutex> lock(fMutex);
+                fCond.wait(lock, [this]() { return fStop || !fJobs.empty(); });
+
+                if (fJobs.empty())
+                    return;
+
+                job = std::move(fJobs.front());
+                fJobs.pop_front();
+            }
+
+            job();
+        }
+    }
+
+public:
+    ThreadPool(size_t num=0) : fStop(false)
+    {
+        Start(num);
+    }
+
+    ~ThreadPool()
+    {
+        Stop();
+    }
+
+    // Stop the current workers (after finishing all pending jobs) and start num new ones
+    void Start(size_t num)
+    {
+        Stop();
+
+        fStop = false;
+        for (size_t i=0; i<num; i++)
+            fThreads.emplace_back(&ThreadPool::Loop, this);
+    }
+
+    // Finish all pending jobs and join the workers
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fStop = true;
+        }
+        fCond.notify_all();
+
+        for (auto it=fThreads.begin(); it!=fThreads.end(); it++)
+            it->join();
+
+        fThreads.clear();
+    }
+
+    size_t GetNumThreads() const { return fThreads.size(); }
+
+    // Queue a job. Exceptions thrown by the job are handed back through the future.
+    std::future<void> Submit(const std::function<void()> &func)
+    {
+        const std::shared_ptr<std::packaged_task<void()>> task =
+            std::make_shared<std::packaged_task<void()>>(func);
+
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fJobs.emplace_back([task]() { (*task)(); });
+        }
+        fCond.notify_one();
+
+        return task->get_future();
+    }
+};
+
+#endif
@@ -8,8 +8,17 @@
 #ifndef MARS_zfits
 #define MARS_zfits
 
+#include <map>
+#include <list>
+#include <deque>
+#include <memory>
+#include <future>
+
 #include "fits.h"
 #include "huffman.h"
+#include "tans.h"
+#include "threadpool.h"
+#include "asyncread.h"
 
 #include "FITS.h"
 
@@ -18,21 +27,328 @@ class zfits : public fits
 public:
 
     // Basic constructor
-    zfits(const std::string& fname, const std::string& tableName="", bool force=false)
-        : fCatalogInitialized(false), fNumTiles(0), fNumRowsPerTile(0), fCurrentRow(-1), fHeapOff(0), fTileSize(0)
+    zfits(const std::string& fname, const std::string& tableName="", bool force=false,
+          IOBackend::Type_t backend=IOBackend::kStream)
+        : fCatalogInitialized(false), fNumTiles(0), fNumRowsPerTile(0), fCurrentRow(-1), fLastTileRead(-1), fHeapOff(0), fTileSize(0),
+          fReadAheadDepth(0), fMinRangeSize(1<<16), fDirectDecoding(false), fProjection(false), fNumAddressesRequired(-1), fNumBatchColumns(0), fRawsumIncomplete(false),
+          fCacheSize(0), fCacheUsed(0), fCacheHits(0), fCacheMisses(0), fRecoverCatalog(false)
     {
-        open(fname.c_str());
+        Open(fname, backend);
         Constructor(fname, "", tableName, force);
     }
 
     // Alternative constructor
-    zfits(const std::string& fname, const std::string& fout, const std::string& tableName, bool force=false)
-        : fCatalogInitialized(false), fNumTiles(0), fNumRowsPerTile(0), fCurrentRow(-1), fHeapOff(0), fTileSize(0)
+    zfits(const std::string& fname, const std::string& fout, const std::string& tableName, bool force=false,
+          IOBackend::Type_t backend=IOBackend::kStream)
+        : fCatalogInitialized(false), fNumTiles(0), fNumRowsPerTile(0), fCurrentRow(-1), fLastTileRead(-1), fHeapOff(0), fTileSize(0),
+          fReadAheadDepth(0), fMinRangeSize(1<<16), fDirectDecoding(false), fProjection(false), fNumAddressesRequired(-1), fNumBatchColumns(0), fRawsumIncomplete(false),
+          fCacheSize(0), fCacheUsed(0), fCacheHits(0), fCacheMisses(0), fRecoverCatalog(false)
     {
-        open(fname.c_str());
+        Open(fname, backend);
         Constructor(fname, fout, tableName, force);
     }
 
+    // Read from a backend, e.g. a MemoryBackend for a file already in memory.
+    // Takes ownership of the backend.
+    zfits(IOBackend *backend, const std::string& tableName="", bool force=false)
+        : fCatalogInitialized(false), fNumTiles(0), fNumRowsPerTile(0), fCurrentRow(-1), fLastTileRead(-1), fHeapOff(0), fTileSize(0),
+          fReadAheadDepth(0), fMinRangeSize(1<<16), fDirectDecoding(false), fProjection(false), fNumAddressesRequired(-1), fNumBatchColumns(0), fRawsumIncomplete(false),
+          fCacheSize(0), fCacheUsed(0), fCacheHits(0), fCacheMisses(0), fRecoverCatalog(false)
+    {
+        SetBackend(backend);
+        Constructor("", "", tableName, force);
+    }
+
+    // Open another table of the same file, see fits(const fits&, ...)
+    zfits(const fits &file, const std::string& tableName, bool force=false)
+        : fCatalogInitialized(false), fNumTiles(0), fNumRowsPerTile(0), fCurrentRow(-1), fLastTileRead(-1), fHeapOff(0), fTileSize(0),
+          fReadAheadDepth(0), fMinRangeSize(1<<16), fDirectDecoding(false), fProjection(false), fNumAddressesRequired(-1), fNumBatchColumns(0), fRawsumIncomplete(false),
+          fCacheSize(0), fCacheUsed(0), fCacheHits(0), fCacheMisses(0), fRecoverCatalog(false)
+    {
+        Share(file);
+        Constructor("", "", tableName, force);
+    }
+
+    ~zfits()
+    {
+        // Workers still reference queued tiles
+        FlushReadAhead();
+        fThreads.Stop();
+
+        // The background thread still adds to fRawsum
+        WaitForChecksums();
+    }
+
+    // Uncompress the columns of a row directly to the addresses set with
+    // SetPtrAddress, instead of through the tile, row and column buffers.
+    // This is only possible for files with one row per tile and without
+    // read-ahead; otherwise rows are read as usual.
+    void EnableDirectDecoding(bool b=true)
+    {
+        fDirectDecoding = b;
+    }
+
+    void DisableDirectDecoding()
+    {
+        EnableDirectDecoding(false);
+    }
+
+    // Only uncompress the columns which have an address set with
+    // SetPtrAddress. Columns can still be added later. As the raw
+    // data is not complete anymore, RAWSUM cannot be verified and
+    // IsFileOk only checks DATASUM.
+    void EnableColumnProjection(bool b=true)
+    {
+        fProjection = b;
+        fNumAddressesRequired = -1;
+    }
+
+    void DisableColumnProjection()
+    {
+        EnableColumnProjection(false);
+    }
+
+    using fits::GetRow;
+
+    virtual bool GetRow(size_t row, bool check=true)
+    {
+        if (!fDirectDecoding || !fTable.is_compressed)
+            return fits::GetRow(row, check);
+
+        if (check && row>=fTable.num_rows)
+            return false;
+
+        if (row >= GetNumRows())
+            return false;
+
+        if (!fCatalogInitialized)
+            InitCompressionReading();
+
+        if (fNumRowsPerTile!=1 || fReadAheadDepth>0)
+            return fits::GetRow(row, check);
+
+        return ReadDirectRow(row);
+    }
+
+    // Uncompress the tiles following the current one in the background.
+    // numThreads workers uncompress up to numTiles tiles (default: twice
+    // the number of threads) ahead of the current row and hand them back
+    // in order. Reading from disk, checksumming and writing the copy file
+    // still happen on the caller's thread, in file order. Zero threads
+    // switches back to uncompressing on the caller's thread only.
+    void SetReadAhead(size_t numThreads, size_t numTiles=0)
+    {
+        FlushReadAhead();
+
+        fThreads.Start(numThreads);
+        fReadAheadDepth = numThreads==0 ? 0 : (numTiles==0 ? 2*numThreads : numTiles);
+    }
+
+    // Decode the Huffman coded chunks of a column (one per row in row
+    // ordered tiles) with numThreads workers besides the caller, so that
+    // the first row of a newly read tile is available sooner. Each worker
+    // decodes at least minRangeSize compressed bytes; columns smaller than
+    // that are decoded by the caller only. Zero threads switches it off.
+    void SetParallelDecoding(size_t numThreads, size_t minRangeSize=1<<16)
+    {
+        // The read-ahead workers use the decoding workers, too
+        FlushReadAhead();
+
+        fDecodeThreads.Start(numThreads);
+        fMinRangeSize = std::max<size_t>(minRangeSize, 1);
+    }
+
+    // Read the rows tile by tile: the rows of a tile are processed
+    // together and then distributed to the columns.
+    virtual size_t GetRows(size_t first, size_t count, const Pointers &columns)
+    {
+        if (!fTable.is_compressed)
+            return fits::GetRows(first, count, columns);
+
+        Addresses addresses;
+        if (!GetColumnAddresses(columns, addresses))
+            return 0;
+
+        if (first>=GetNumRows())
+            return 0;
+
+        count = std::min(count, GetNumRows()-first);
+
+        if (!fCatalogInitialized)
+            InitCompressionReading();
+
+        // With the column projection, these columns have to be uncompressed as well
+        AddBatchColumns(addresses);
+
+        const size_t bytesPerRow = fTable.bytes_per_row;
+
+        size_t done = 0;
+        while (done<count && good())
+        {
+            const size_t row = first+done;
+
+            LoadTile(row / fNumRowsPerTile);
+
+            // rows of this tile in the requested range
+            const size_t beg = row%fNumRowsPerTile;
+            const size_t num = std::min<size_t>(fTile.numRows-beg, count-done);
+
+            fCurrentRow = row+num-1;
+
+            // Same as StageRow and WriteRowToCopyFile, but for all rows at once.
+            // For the checksum the rows have to be at the right 32 bits alignment.
+            const uint8_t offset = (row*bytesPerRow)%4;
+
+            fBufferRows.resize(num*bytesPerRow+4);
+
+            char *rows = fBufferRows.data()+offset;
+            memcpy(rows, fTile.buffer.data()+beg*bytesPerRow, num*bytesPerRow);
+
+            ProcessRows(rows, num);
+
+            if (row == fRow+1)
+                AddToChecksum(fRawsum, rows, num*bytesPerRow, offset);
+
+            fRow = row+num-1;
+
+            for (auto it=addresses.cbegin(); it!=addresses.cend(); it++)
+            {
+                const Table::Column &c = it->second;
+
+                char *dest = reinterpret_cast<char*>(it->first) + done*c.bytes;
+                for (size_t i=0; i<num; i++, dest+=c.bytes)
+                    MoveColumnDataToUserSpace(dest, rows+i*bytesPerRow+c.offset, c);
+            }
+
+            done += num;
+        }
+
+        return done;
+    }
+
+    // Read the given rows, e.g. a preselection of events. For each column
+    // in columns, the data of rows[i] is stored at address+i*bytes of the
+    // column, like with GetRows. The reads of all tiles needed are
+    // submitted together (through io_uring where available, otherwise by
+    // a pool of threads) and the tiles are uncompressed as they arrive,
+    // by the read-ahead workers if started. Up to queueDepth tiles are in
+    // flight. Neither the checksums nor the current row are changed.
+    // Returns the number of rows read.
+    size_t FetchRows(const std::vector<size_t> &rows, const Pointers &columns, size_t queueDepth=32)
+    {
+        if (!fTable.is_compressed)
+            return fits::FetchRows(rows, columns);
+
+        Addresses addresses;
+        if (!GetColumnAddresses(columns, addresses))
+            return 0;
+
+        for (auto it=rows.cbegin(); it!=rows.cend(); it++)
+            if (*it>=GetNumRows())
+                return 0;
+
+        if (!fCatalogInitialized)
+            InitCompressionReading();
+
+        if (!good())
+            return 0;
+
+        // With the column projection, these columns have to be uncompressed as well
+        AddBatchColumns(addresses);
+        GetRequiredColumns();
+
+        // Requested rows of each tile, in file order
+        std::map<int64_t, std::vector<size_t>> tiles;
+        for (size_t i=0; i<rows.size(); i++)
+            tiles[rows[i]/fNumRowsPerTile].push_back(i);
+
+        const std::vector<std::pair<int64_t, std::vector<size_t>>> list(tiles.begin(), tiles.end());
+
+        queueDepth = std::max<size_t>(queueDepth, 1);
+
+        FetchState state(queueDepth);
+
+        try
+        {
+            FetchTiles(state, list, rows, addresses);
+        }
+        catch (...)
+        {
+            // Reads and uncompression in flight still use the tiles
+            state.reader.reset();
+            for (auto it=state.decoding.begin(); it!=state.decoding.end(); it++)
+                if (it->second->ready.valid())
+                    it->second->ready.wait();
+
+            clear(rdstate()|std::ios::badbit);
+            throw;
+        }
+
+        // Do not keep more spare tiles than the read-ahead needs
+        if (fFreeTiles.size()>fReadAheadDepth+1)
+            fFreeTiles.resize(fReadAheadDepth+1);
+
+        return rows.size();
+    }
+
+    // Keep recently used uncompressed tiles in memory, up to a total of
+    // maxBytes, so that going back to them does not need to read and
+    // uncompress them again. Zero disables the cache.
+    void SetTileCache(size_t maxBytes)
+    {
+        fCacheSize = maxBytes;
+        ShrinkTileCache();
+    }
+
+    size_t GetTileCacheHits() const { return fCacheHits; }
+    size_t GetTileCacheMisses() const { return fCacheMisses; }
+
+    // Build the catalog from the tiles in the heap instead of reading
+    // it from the file. This opens files whose writer did not finish,
+    // e.g. because it crashed, and whose catalog was never written.
+    // Only complete tiles are used, and the number of rows is set to
+    // the rows found in them. Should be called before reading rows.
+    // Returns the number of rows.
+    size_t RecoverCatalog()
+    {
+        if (!fTable.is_compressed)
+            return GetNumRows();
+
+        FlushReadAhead();
+
+        // Cached tiles could have been cataloged differently
+        const size_t cacheSize = fCacheSize;
+        SetTileCache(0);
+        SetTileCache(cacheSize);
+
+        fTile.index   = -1;
+        fCurrentRow   = -1;
+        fLastTileRead = -1;
+        fRow          = -1;
+
+        fSubTiles.clear();
+        fSubTileOffsets.clear();
+
+        // Reading stopped at the end of a truncated file
+        clear();
+        seekg(fTable.offset);
+
+        fRecoverCatalog = true;
+        InitCompressionReading();
+
+        return GetNumRows();
+    }
+
+    // For files with a shrunk catalog (ZSHRINK>1), the position of the
+    // sub-tiles is not in the catalog. At the first random access to a
+    // sub-tile, all tile headers are read once to build an index of them.
+    // If a file name is given here, the index is read from it instead,
+    // or written to it once built.
+    void SetSubTileIndexFile(const std::string &fname)
+    {
+        fSubTileIndexFile = fname;
+    }
+
     //  Skip the next row
     bool SkipNextRow()
     {
@@ -45,25 +361,55 @@ public:
 
     virtual bool IsFileOk() const
     {
-        if (!HasKey("RAWSUM"))
-            return fits::IsFileOk();
+        // Also false while the checksums are pending
+        if (!fits::IsFileOk())
+            return false;
+
+        if (!HasKey("RAWSUM") || fRawsumIncomplete)
+            return true;
 
-        const bool rawsum = GetStr("RAWSUM") == std::to_string((long long int)fRawsum.val());
-        return fits::IsFileOk() && rawsum;
+        return GetStr("RAWSUM") == std::to_string((long long int)fRawsum.val());
     };
 
+    // The header values are cached in the table, (Z)NAXIS2 and (Z)NAXIS1
     size_t GetNumRows() const
     {
-        return fTable.Get<size_t>(fTable.is_compressed ? "ZNAXIS2" : "NAXIS2");
+        return fTable.num_rows;
     }
 
     size_t GetBytesPerRow() const
     {
-        return fTable.Get<size_t>(fTable.is_compressed ? "ZNAXIS1" : "NAXIS1");
+        return fTable.bytes_per_row;
     }
 
 protected:
 
+    // Called after a row was uncompressed directly to the user's memory,
+    // before the raw checksum is computed. columns[i] points to the data
+    // of the i-th column of GetSortedColumns().
+    virtual void ProcessDirectRow(const std::vector<char*> &/*columns*/)
+    {
+    }
+
+    // Called for rows read by GetRows, before the raw checksum is computed.
+    // rows holds numRows consecutive rows.
+    virtual void ProcessRows(char */*rows*/, size_t /*numRows*/)
+    {
+    }
+
+    // Mark the columns (index in GetSortedColumns()) which have to be
+    // uncompressed, in addition to the ones with an address, when the
+    // column projection is enabled
+    virtual void AddRequiredColumns(std::vector<char> &/*required*/)
+    {
+    }
+
+    // Is the i-th column of GetSortedColumns() uncompressed for the rows being read?
+    bool IsColumnUncompressed(size_t i) const
+    {
+        return i<fRequired.size() && fRequired[i];
+    }
+
     //  Stage the requested row to internal buffer
     //  Does NOT return data to users
     virtual void StageRow(size_t row, char* dest)
@@ -100,8 +446,6 @@ private:
                 throw std::runtime_error("Only the FACT compression scheme is handled by this reader.");
             }
 
-        fColumnOrdering.resize(fTable.sorted_cols.size(), FITS::kOrderByRow);
-
         //Get compressed specific keywords
         fNumTiles       = fTable.is_compressed ? GetInt("NAXIS2") : 0;
         fNumRowsPerTile = fTable.is_compressed ? GetInt("ZTILELEN") : 0;
@@ -110,7 +454,7 @@ private:
         ReadCatalog();
 
         //give it some space for uncompressing
-        AllocateBuffers();
+        AllocateTile(fTile);
     }
 
     // Copy decompressed data to location requested by user
@@ -125,16 +469,35 @@ private:
         memcpy(dest, src, c.num*c.size);
     }
 
+    // All buffers needed to read and uncompress one (sub-)tile
+    struct Tile
+    {
+        int64_t  index;                ///< index of the (sub-)tile held, -1 if none
+        uint32_t numRows;              ///< number of rows in this tile
+        uint32_t offset;               ///< 32 bits alignment of the tile in compressed, required for checksumming
+        std::vector<size_t> offsets;   ///< offset from start of tile of each compressed column
+        std::vector<char> compressed;  ///< compressed rows
+        const char       *data;        ///< start of the tile, in compressed or in the memory of the backend
+        std::vector<char> transposed;  ///< intermediate buffer to transpose the rows
+        std::vector<char> buffer;      ///< store the uncompressed rows
+        std::vector<char> ordering;    ///< ordering of the column's rows. Can change from tile to tile.
+        std::vector<char> required;    ///< columns which are uncompressed
+        std::vector<Huffman::Decoder> decoders;            ///< kFactHuffman16: one per range of chunks decoded in parallel, the first one also serially
+        std::vector<Huffman::CanonicalDecoder> canonicals; ///< the same for kFactHuffman16Canonical
+        std::vector<TANS::Decoder> ansDecoders;            ///< the same for kFactTANS16
+        std::future<void> ready;       ///< valid while a worker is uncompressing the tile
+
+        Tile() : index(-1), numRows(0), offset(0), data(NULL), decoders(1), canonicals(1), ansDecoders(1) { }
+    };
+
     bool  fCatalogInitialized;
 
-    std::vector<char> fBuffer;           ///<store the uncompressed rows
-    std::vector<char> fTransposedBuffer; ///<intermediate buffer to transpose the rows
-    std::vector<char> fCompressedBuffer; ///<compressed rows
-    std::vector<char> fColumnOrdering;   ///< ordering of the column's rows. Can change from tile to tile.
+    Tile fTile; ///< the tile the current row belongs to
 
     size_t fNumTiles;       ///< Total number of tiles
     size_t fNumRowsPerTile; ///< Number of rows per compressed tile
     int64_t fCurrentRow;    ///< current row in memory signed because we need -1
+    int64_t fLastTileRead;  ///< last (sub-)tile read from disk, -1 if none
     size_t fShrinkFactor;   ///< shrink factor
 
     streamoff fHeapOff;           ///< offset from the beginning of the file of the binary data
@@ -144,10 +507,47 @@ private:
     std::vector<size_t>                                   fTileSize;    ///< size in bytes of each compressed tile
     std::vector<std::vector<size_t>>                      fTileOffsets; ///< offset from start of tile of a given compressed column
 
+    std::vector<int64_t>             fSubTiles;         ///< offset from the beginning of the heap of all sub-tiles, see GetSubTileIndex
+    std::vector<std::vector<size_t>> fSubTileOffsets;   ///< offsets of the compressed columns of each sub-tile, once known
+    std::string                      fSubTileIndexFile; ///< file to keep fSubTiles in
+
     Checksum fRawsum;   ///< Checksum of the uncompressed, raw data
 
+    ThreadPool fThreads;                         ///< workers uncompressing tiles ahead of the current one
+    size_t     fReadAheadDepth;                  ///< number of tiles to keep in flight
+    std::deque<std::unique_ptr<Tile>> fReadAhead; ///< tiles being uncompressed, in file order
+    std::vector<std::unique_ptr<Tile>> fFreeTiles; ///< spare tiles for the read-ahead
+
+    ThreadPool fDecodeThreads;  ///< workers decoding the Huffman coded chunks of a column together
+    size_t     fMinRangeSize;   ///< minimum number of compressed bytes decoded by one worker
+
+    bool               fDirectDecoding; ///< uncompress columns directly to the user's addresses
+    std::vector<char*> fDirectColumns;  ///< where each column of the current row was uncompressed to
+
+    bool              fProjection;           ///< only uncompress columns with an address
+    std::vector<char> fRequired;             ///< columns to be uncompressed, see GetRequiredColumns
+    size_t            fNumAddressesRequired; ///< number of addresses fRequired was filled for
+    std::vector<char> fBatchColumns;         ///< columns requested through GetRows
+    size_t            fNumBatchColumns;      ///< number of columns requested through GetRows
+    bool              fRawsumIncomplete;     ///< rows were read without all columns uncompressed
+
+    std::vector<char> fBufferRows; ///< rows of a tile processed by GetRows
+
+    typedef std::list<std::unique_ptr<Tile>> TileCache;
+
+    TileCache                                          fCache;      ///< uncompressed tiles, most recently used first
+    std::unordered_map<int64_t, TileCache::iterator>   fCacheIndex; ///< position of each tile in fCache
+    size_t                                             fCacheSize;  ///< maximum memory used by the cached tiles
+    size_t                                             fCacheUsed;  ///< memory used by the cached tiles
+    size_t                                             fCacheHits;
+    size_t                                             fCacheMisses;
+
+    bool fRecoverCatalog; ///< build the catalog from the heap instead of reading it, see RecoverCatalog
+
+    enum { kHeapBlockSize = 1<<22 }; ///< bytes read at once when scanning the heap
+
     // Get buffer space
-    void AllocateBuffers()
+    void AllocateTile(Tile &tile)
     {
         uint32_t buffer_size = fTable.bytes_per_row*fNumRowsPerTile;
         uint32_t compressed_buffer_size = fTable.bytes_per_row*fNumRowsPerTile +
@@ -164,10 +564,12 @@ private:
         if (compressed_buffer_size % 4 != 0)
             compressed_buffer_size += 4 - (compressed_buffer_size%4);
 
-        fBuffer.resize(buffer_size);
+        tile.buffer.resize(buffer_size);
 
-        fTransposedBuffer.resize(buffer_size);
-        fCompressedBuffer.resize(compressed_buffer_size);
+        tile.transposed.resize(buffer_size);
+        tile.compressed.resize(compressed_buffer_size);
+        tile.ordering.resize(fTable.sorted_cols.size(), FITS::kOrderByRow);
+        tile.required.resize(fTable.sorted_cols.size(), true);
     }
 
     // Read catalog data. I.e. the address of the compressed data inside the heap
@@ -178,10 +580,15 @@ private:
 
         const streampos catalogStart = tellg();
 
+        WaitForChecksums();
         fChkData.reset();
 
+        //the catalog is built from the heap instead, see RebuildCatalog
+        if (fRecoverCatalog)
+            seekg(fNumTiles*fTable.num_cols*2*sizeof(int64_t), cur);
+
         //do the actual reading
-        for (uint32_t i=0;i<fNumTiles;i++)
+        for (uint32_t i=0;i<fNumTiles && !fRecoverCatalog;i++)
             for (uint32_t j=0;j<fTable.num_cols;j++)
             {
                 read(readBuf.data(), 2*sizeof(int64_t));
@@ -214,12 +621,21 @@ private:
         if (fShrinkFactor>0)
             fNumRowsPerTile /= fShrinkFactor;
 
+        if (fRecoverCatalog)
+            RebuildCatalog();
+
+        //column offsets of the sub-tiles are only known once read
+        if (fShrinkFactor>1)
+            fSubTileOffsets.resize(GetNumTiles());
+
         //compute the total size of each compressed tile
         fTileSize.resize(fNumTiles);
         fTileOffsets.resize(fNumTiles);
         for (uint32_t i=0;i<fNumTiles;i++)
         {
             fTileSize[i] = 0;
+            //the catalog can be read again, see RecoverCatalog
+            fTileOffsets[i].clear();
             for (uint32_t j=0;j<fTable.num_cols;j++)
             {
                 fTileSize[i] += fCatalog[i][j].first;
@@ -248,229 +664,1150 @@ private:
     virtual void WriteRowToCopyFile(size_t row)
     {
         if (row == fRow+1)
-            fRawsum.add(fBufferRow);
+            AddToChecksum(fRawsum, fBufferRow.data()+(row*fTable.bytes_per_row)%4, fTable.bytes_per_row, row*fTable.bytes_per_row);
     }
 
-    // Compressed version of the read row, even files with shrunk catalogs
-    // can be read fully sequentially so that streaming, e.g. through
-    // stdout/stdin, is possible.
-    bool ReadBinaryRow(const size_t &rowNum, char *bufferToRead)
+    // Columns requested through GetRows stay required, like the
+    // ones with an address
+    void AddBatchColumns(const Addresses &addresses)
     {
-        if (rowNum >= GetNumRows())
-            return false;
-
-        if (!fCatalogInitialized)
-            InitCompressionReading();
-
-        // Book keeping, where are we?
-        const int64_t requestedTile      = rowNum        / fNumRowsPerTile;
-        const int64_t currentTile        = fCurrentRow   / fNumRowsPerTile;
+        const Table::SortedColumns &cols = fTable.sorted_cols;
 
-        const int64_t requestedSuperTile = requestedTile / fShrinkFactor;
-        //const int64_t currentSuperTile   = currentTile   / fShrinkFactor;
+        fBatchColumns.resize(cols.size());
 
-        const int64_t requestedSubTile   = requestedTile % fShrinkFactor;
-        //const int64_t currentSubTile     = currentTile   % fShrinkFactor;
+        for (auto it=addresses.cbegin(); it!=addresses.cend(); it++)
+            for (size_t i=0; i<cols.size(); i++)
+                if (cols[i].offset==it->second.offset && !fBatchColumns[i])
+                {
+                    fBatchColumns[i] = true;
+                    fNumBatchColumns++;
+                }
+    }
 
-        // Is this the first tile we read at all?
-        const bool isFirstTile = fCurrentRow<0;
+    // Columns to be uncompressed. As addresses can only be added,
+    // this needs to be updated only if their number changed.
+    const std::vector<char> &GetRequiredColumns()
+    {
+        if (fNumAddressesRequired==fAddresses.size()+fNumBatchColumns)
+            return fRequired;
 
-        // Is this just the next tile in the sequence?
-        const bool isNextTile = requestedTile==currentTile+1 || isFirstTile;
+        const Table::SortedColumns &cols = fTable.sorted_cols;
 
-        fCurrentRow = rowNum;
+        fRequired.assign(cols.size(), !fProjection);
 
-        // Do we have to read a new tile from disk?
-        if (requestedTile!=currentTile || isFirstTile)
+        if (fProjection)
         {
-            //skip to the beginning of the tile
-            const int64_t superTileStart = fCatalog[requestedSuperTile][0].second - sizeof(FITS::TileHeader);
+            for (auto it=fAddresses.cbegin(); it!=fAddresses.cend(); it++)
+                for (size_t i=0; i<cols.size(); i++)
+                    if (cols[i].offset==it->second.offset)
+                        fRequired[i] = true;
 
-            std::vector<size_t> offsets = fTileOffsets[requestedSuperTile];
+            for (size_t i=0; i<fBatchColumns.size(); i++)
+                if (fBatchColumns[i])
+                    fRequired[i] = true;
 
-            // If this is a sub tile we might have to step forward a bit and
-            // seek for the sub tile. If we were just reading the previous one
-            // we can skip that.
-            if (!isNextTile || isFirstTile)
-            {
-                // step to the beginnig of the super tile
-                seekg(fHeapOff+superTileStart);
+            AddRequiredColumns(fRequired);
+        }
 
-                // If there are sub tiles we might have to seek through the super tile
-                for (uint32_t k=0; k<requestedSubTile; k++)
-                {
-                    // Read header
-                    FITS::TileHeader header;
-                    read((char*)&header, sizeof(FITS::TileHeader));
+        fNumAddressesRequired = fAddresses.size()+fNumBatchColumns;
 
-                    // Skip to the next header
-                    seekg(header.size-sizeof(FITS::TileHeader), cur);
-                }
-            }
+        return fRequired;
+    }
 
-            // this is now the beginning of the sub-tile we want to read
-            const int64_t subTileStart = tellg() - fHeapOff;
-            // calculate the 32 bits offset of the current tile.
-            const uint32_t offset = (subTileStart + fHeapFromDataStart)%4;
+    // Check that all required columns of the tile are uncompressed. The
+    // ones which are not have an address which was added later.
+    void UpdateRequiredColumns(Tile &tile)
+    {
+        const std::vector<char> &required = GetRequiredColumns();
 
-            // start of destination buffer (padding comes later)
-            char *destBuffer = fCompressedBuffer.data()+offset;
+        bool missing = false;
+        for (size_t i=0; i<required.size(); i++)
+            missing |= required[i] && !tile.required[i];
 
-            // Store the current tile size once known
-            size_t currentTileSize = 0;
+        if (missing)
+        {
+            tile.required = required;
 
-            // If this is a request for a sub tile which is not cataloged
-            // recalculate the offsets from the buffer, once read
-            if (requestedSubTile>0)
+            try
             {
-                // Read header
-                read(destBuffer, sizeof(FITS::TileHeader));
-
-                // Get size of tile
-                currentTileSize = reinterpret_cast<FITS::TileHeader*>(destBuffer)->size;
-
-                // now read the remaining bytes of this tile
-                read(destBuffer+sizeof(FITS::TileHeader), currentTileSize-sizeof(FITS::TileHeader));
-
-                // Calculate the offsets recursively
-                offsets[0] = 0;
-
-                //skip through the columns
-                for (size_t i=0; i<fTable.num_cols-1; i++)
-                {
-                    //zero sized column do not have headers. Skip it
-                    if (fTable.sorted_cols[i].num == 0)
-                    {
-                        offsets[i+1] = offsets[i];
-                        continue;
-                    }
-
-                    const char *pos = destBuffer + offsets[i] + sizeof(FITS::TileHeader);
-                    offsets[i+1] = offsets[i] + reinterpret_cast<const FITS::BlockHeader*>(pos)->size;
-                }
+                UncompressTile(tile);
             }
-            else
+            catch (...)
             {
-                // If we are reading the first tile of a super tile, all information
-                // is already available.
-                currentTileSize = fTileSize[requestedSuperTile] + sizeof(FITS::TileHeader);
-                read(destBuffer, currentTileSize);
+                // The tile buffer is not valid anymore
+                fCurrentRow = -1;
+
+                clear(rdstate()|std::ios::badbit);
+                throw;
             }
+        }
 
+        // The raw checksum is calculated from the whole row
+        for (size_t i=0; i<tile.required.size(); i++)
+            if (fTable.sorted_cols[i].num>0 && !tile.required[i])
+                fRawsumIncomplete = true;
+    }
 
-            // If we are reading sequentially, calcualte checksum
-            if (isNextTile)
-            {
-                // Padding for checksum calculation
-                memset(fCompressedBuffer.data(),   0, offset);
-                memset(destBuffer+currentTileSize, 0, fCompressedBuffer.size()-currentTileSize-offset);
-                fChkData.add(fCompressedBuffer);
-            }
+    // Make sure the requested tile is uncompressed in fTile
+    void LoadTile(int64_t requestedTile)
+    {
+        // Do we have to read a new tile from disk? fCurrentRow<0 means
+        // that fTile does not hold a valid tile.
+        if (fCurrentRow>=0 && requestedTile==fCurrentRow/int64_t(fNumRowsPerTile))
+        {
+            UpdateRequiredColumns(fTile);
+            return;
+        }
 
-            // Check if we are writing a copy of the file
-            if (isNextTile && fCopy.is_open() && fCopy.good())
+        if (fCacheSize>0)
+        {
+            if (GetTileFromCache(requestedTile))
             {
-                fCopy.write(fCompressedBuffer.data()+offset, currentTileSize);
-                if (!fCopy)
-                    clear(rdstate()|std::ios::badbit);
+                UpdateRequiredColumns(fTile);
+                return;
             }
-            else
-                if (fCopy.is_open())
-                    clear(rdstate()|std::ios::badbit);
 
+            fCacheMisses++;
+        }
 
-            // uncompress  the buffer
-            const uint32_t thisRoundNumRows = (GetNumRows()<fCurrentRow + fNumRowsPerTile) ? GetNumRows()%fNumRowsPerTile : fNumRowsPerTile;
-            if (!UncompressBuffer(offsets, thisRoundNumRows, offset+sizeof(FITS::TileHeader)))
-                return false;
+        if (fReadAheadDepth>0)
+            ReadAheadTile(requestedTile);
+        else
+        {
+            AddCurrentTileToCache();
 
-            // pointer to column (source buffer)
-            const char *src = fTransposedBuffer.data();
+            ReadTile(fTile, requestedTile);
 
-            uint32_t i=0;
-            for (auto it=fTable.sorted_cols.cbegin(); it!=fTable.sorted_cols.cend(); it++, i++)
+            try
             {
-                char *buffer = fBuffer.data() + it->offset; // pointer to column (destination buffer)
-
-                switch (fColumnOrdering[i])
-                {
-                case FITS::kOrderByRow:
-                    // regular, "semi-transposed" copy
-                    for (char *dest=buffer; dest<buffer+thisRoundNumRows*fTable.bytes_per_row; dest+=fTable.bytes_per_row) // row-by-row
-                    {
-                        memcpy(dest, src, it->bytes);
-                        src += it->bytes;  // next column
-                    }
-                    break;
+                UncompressTile(fTile);
+            }
+            catch (...)
+            {
+                fCurrentRow = -1;
 
-                case FITS::kOrderByCol:
-                    // transposed copy
-                    for (char *elem=buffer; elem<buffer+it->bytes; elem+=it->size) // element-by-element (arrays)
-                    {
-                        for (char *dest=elem; dest<elem+thisRoundNumRows*fTable.bytes_per_row; dest+=fTable.bytes_per_row) // row-by-row
-                        {
-                                memcpy(dest, src, it->size);
-                                src += it->size; // next element
-                        }
-                    }
-                    break;
+                clear(rdstate()|std::ios::badbit);
+                throw;
+            }
+        }
 
-                default:
-                    clear(rdstate()|std::ios::badbit);
+        UpdateRequiredColumns(fTile);
+    }
 
-                    std::ostringstream str;
-                    str << "Unkown column ordering scheme found (i=" << i << ", " << fColumnOrdering[i] << ")";
-                    throw std::runtime_error(str.str());
-                };
-            }
+    // A tile which is not in use, e.g. for the read-ahead
+    std::unique_ptr<Tile> GetFreeTile()
+    {
+        std::unique_ptr<Tile> tile;
+        if (fFreeTiles.empty())
+        {
+            tile.reset(new Tile);
+            AllocateTile(*tile);
+        }
+        else
+        {
+            tile = std::move(fFreeTiles.back());
+            fFreeTiles.pop_back();
         }
 
-        //Data loaded and uncompressed. Copy it to destination
-        memcpy(bufferToRead, fBuffer.data()+fTable.bytes_per_row*(fCurrentRow%fNumRowsPerTile), fTable.bytes_per_row);
-        return good();
+        return tile;
     }
 
-    // Read a bunch of uncompressed data
-    uint32_t UncompressUNCOMPRESSED(char*       dest,
-                                    const char* src,
-                                    uint32_t    numElems,
-                                    uint32_t    sizeOfElems)
+    // Memory used by a tile
+    static size_t GetTileMemory(const Tile &tile)
     {
-        memcpy(dest, src, numElems*sizeOfElems);
-        return numElems*sizeOfElems;
+        return tile.buffer.capacity() + tile.transposed.capacity() + tile.compressed.capacity();
     }
 
-    // Read a bunch of data compressed with the Huffman algorithm
-    uint32_t UncompressHUFFMAN16(char*       dest,
-                                 const char* src,
-                                 uint32_t    numChunks)
+    // Swap the requested tile from the cache into fTile. The tile
+    // which was in fTile takes its place in the cache.
+    bool GetTileFromCache(int64_t requestedTile)
     {
-        std::vector<uint16_t> uncompressed;
+        const auto it = fCacheIndex.find(requestedTile);
+        if (it==fCacheIndex.end())
+            return false;
 
-        //read compressed sizes (one per row)
-        const uint32_t* compressedSizes = reinterpret_cast<const uint32_t*>(src);
-        src += sizeof(uint32_t)*numChunks;
+        std::unique_ptr<Tile> tile = std::move(*it->second);
+        fCache.erase(it->second);
+        fCacheIndex.erase(it);
+        fCacheUsed -= GetTileMemory(*tile);
 
-        //uncompress the rows, one by one
-        uint32_t sizeWritten = 0;
-        for (uint32_t j=0;j<numChunks;j++)
-        {
-            Huffman::Decode(reinterpret_cast<const unsigned char*>(src), compressedSizes[j], uncompressed);
+        AddCurrentTileToCache();
 
-            memcpy(dest, uncompressed.data(), uncompressed.size()*sizeof(uint16_t));
+        std::swap(fTile, *tile);
+        fFreeTiles.push_back(std::move(tile));
 
-            sizeWritten += uncompressed.size()*sizeof(uint16_t);
-            dest        += uncompressed.size()*sizeof(uint16_t);
-            src         += compressedSizes[j];
-        }
-        return sizeWritten;
+        fCacheHits++;
+
+        return true;
     }
 
-    // Apply the inverse transform of the integer smoothing
-    uint32_t UnApplySMOOTHING(int16_t*   data,
-                              uint32_t   numElems)
+    // Move the tile in fTile, if valid, to the cache. fTile is replaced by a free tile.
+    void AddCurrentTileToCache()
     {
-        //un-do the integer smoothing
+        if (fCacheSize==0 || fCurrentRow<0 || fTile.index<0)
+            return;
+
+        std::unique_ptr<Tile> tile = GetFreeTile();
+        std::swap(fTile, *tile);
+
+        fCacheUsed += GetTileMemory(*tile);
+
+        fCache.push_front(std::move(tile));
+        fCacheIndex[fCache.front()->index] = fCache.begin();
+
+        // The current row is not in fTile anymore
+        fCurrentRow = -1;
+
+        ShrinkTileCache();
+    }
+
+    // Drop the least recently used tiles until the cache fits its size
+    void ShrinkTileCache()
+    {
+        while (fCacheUsed>fCacheSize && !fCache.empty())
+        {
+            std::unique_ptr<Tile> tile = std::move(fCache.back());
+            fCache.pop_back();
+            fCacheIndex.erase(tile->index);
+            fCacheUsed -= GetTileMemory(*tile);
+
+            // Keep a few for reuse
+            if (fFreeTiles.size()<=fReadAheadDepth)
+                fFreeTiles.push_back(std::move(tile));
+        }
+    }
+
+    // Compressed version of the read row, even files with shrunk catalogs
+    // can be read fully sequentially so that streaming, e.g. through
+    // stdout/stdin, is possible.
+    bool ReadBinaryRow(const size_t &rowNum, char *bufferToRead)
+    {
+        if (rowNum >= GetNumRows())
+            return false;
+
+        if (!fCatalogInitialized)
+            InitCompressionReading();
+
+        LoadTile(rowNum / fNumRowsPerTile);
+
+        fCurrentRow = rowNum;
+
+        //Data loaded and uncompressed. Copy it to destination
+        memcpy(bufferToRead, fTile.buffer.data()+fTable.bytes_per_row*(fCurrentRow%fNumRowsPerTile), fTable.bytes_per_row);
+        return good();
+    }
+
+    // Read a row of a file with one row per tile, uncompressing each column
+    // directly to the first address registered for it. Columns without
+    // address end up in the row buffer.
+    bool ReadDirectRow(size_t row)
+    {
+        // For the checksum the row has to be at the right 32 bits alignment
+        const uint8_t offset = (row*fTable.bytes_per_row)%4;
+
+        const Table::SortedColumns &cols = fTable.sorted_cols;
+
+        fDirectColumns.resize(cols.size());
+        for (size_t i=0; i<cols.size(); i++)
+            fDirectColumns[i] = fBufferRow.data() + offset + cols[i].offset;
+
+        for (auto it=fAddresses.cbegin(); it!=fAddresses.cend(); it++)
+            for (size_t i=0; i<cols.size(); i++)
+                if (cols[i].num>0 && cols[i].offset==it->second.offset && fDirectColumns[i]==fBufferRow.data()+offset+cols[i].offset)
+                    fDirectColumns[i] = reinterpret_cast<char*>(it->first);
+
+        ReadTile(fTile, row);
+
+        try
+        {
+            UncompressBuffer(fTile, &fDirectColumns);
+        }
+        catch (...)
+        {
+            clear(rdstate()|std::ios::badbit);
+            throw;
+        }
+
+        UpdateRequiredColumns(fTile);
+
+        // The tile buffer does not hold this row
+        fCurrentRow = -1;
+
+        ProcessDirectRow(fDirectColumns);
+
+        // Columns registered more than once
+        for (auto it=fAddresses.cbegin(); it!=fAddresses.cend(); it++)
+            for (size_t i=0; i<cols.size(); i++)
+                if (cols[i].num>0 && cols[i].offset==it->second.offset && fDirectColumns[i]!=it->first)
+                    memcpy(it->first, fDirectColumns[i], cols[i].bytes);
+
+        // Same as WriteRowToCopyFile, but column by column
+        if (row == fRow+1)
+            for (size_t i=0; i<cols.size(); i++)
+                AddToChecksum(fRawsum, fDirectColumns[i], cols[i].bytes, offset+cols[i].offset);
+
+        fRow = row;
+
+        return good();
+    }
+
+    // Number of (sub-)tiles in the file
+    size_t GetNumTiles() const
+    {
+        return (GetNumRows()+fNumRowsPerTile-1)/fNumRowsPerTile;
+    }
+
+    // The index of all sub-tiles. Read from the index file, or built
+    // by skipping through all tile headers.
+    const std::vector<int64_t> &GetSubTileIndex()
+    {
+        if (!fSubTiles.empty())
+            return fSubTiles;
+
+        if (ReadSubTileIndex())
+            return fSubTiles;
+
+        const size_t numTiles = GetNumTiles();
+
+        // Sequential reading continues where it is
+        const std::streamoff pos = tellg();
+
+        fSubTiles.reserve(numTiles);
+        for (size_t i=0; i<fNumTiles && fSubTiles.size()<numTiles; i++)
+        {
+            int64_t start = fCatalog[i][0].second - sizeof(FITS::TileHeader);
+
+            for (size_t k=0; k<fShrinkFactor && fSubTiles.size()<numTiles; k++)
+            {
+                FITS::TileHeader header;
+
+                seekg(fHeapOff+start);
+                read((char*)&header, sizeof(FITS::TileHeader));
+
+                if (!good() || memcmp(header.id, "TILE", 4))
+                {
+                    fSubTiles.clear();
+                    clear(rdstate()|std::ios::badbit);
+                    throw std::runtime_error("Tile header not found while indexing the sub-tiles");
+                }
+
+                fSubTiles.push_back(start);
+
+                start += header.size;
+            }
+        }
+
+        seekg(pos);
+
+        WriteSubTileIndex();
+
+        return fSubTiles;
+    }
+
+    // Identifies the file an index file belongs to
+    void GetSubTileIndexHeader(std::vector<int64_t> &header) const
+    {
+        const int64_t magic = 0x3158444e49425553LL; // "SUBINDX1"
+
+        header.assign(1, magic);
+        header.push_back(fHeapOff);
+        header.push_back(fTable.datasum);
+        header.push_back(GetNumTiles());
+    }
+
+    bool ReadSubTileIndex()
+    {
+        if (fSubTileIndexFile.empty())
+            return false;
+
+        std::ifstream fin(fSubTileIndexFile.c_str(), std::ios::binary);
+        if (!fin)
+            return false;
+
+        std::vector<int64_t> expected, header(4);
+        GetSubTileIndexHeader(expected);
+
+        fin.read(reinterpret_cast<char*>(header.data()), header.size()*sizeof(int64_t));
+        if (!fin || header!=expected)
+            return false;
+
+        fSubTiles.resize(GetNumTiles());
+        fin.read(reinterpret_cast<char*>(fSubTiles.data()), fSubTiles.size()*sizeof(int64_t));
+        if (fin)
+            return true;
+
+        fSubTiles.clear();
+        return false;
+    }
+
+    // Failing to write the index is not an error, it is just rebuilt next time
+    void WriteSubTileIndex() const
+    {
+        if (fSubTileIndexFile.empty())
+            return;
+
+        std::vector<int64_t> header;
+        GetSubTileIndexHeader(header);
+
+        std::ofstream fout(fSubTileIndexFile.c_str(), std::ios::binary);
+        fout.write(reinterpret_cast<const char*>(header.data()), header.size()*sizeof(int64_t));
+        fout.write(reinterpret_cast<const char*>(fSubTiles.data()), fSubTiles.size()*sizeof(int64_t));
+    }
+
+    // The offsets of the columns of a sub-tile, which is not cataloged,
+    // from the block headers of the data read
+    void GetSubTileOffsets(Tile &tile, int64_t requestedTile)
+    {
+        std::vector<size_t> &offsets = tile.offsets;
+
+        if (!fSubTileOffsets[requestedTile].empty())
+        {
+            offsets = fSubTileOffsets[requestedTile];
+            return;
+        }
+
+        // Calculate the offsets recursively
+        offsets[0] = 0;
+
+        //skip through the columns
+        for (size_t i=0; i<fTable.num_cols-1; i++)
+        {
+            //zero sized column do not have headers. Skip it
+            if (fTable.sorted_cols[i].num == 0)
+            {
+                offsets[i+1] = offsets[i];
+                continue;
+            }
+
+            const char *pos = tile.data + offsets[i] + sizeof(FITS::TileHeader);
+            offsets[i+1] = offsets[i] + reinterpret_cast<const FITS::BlockHeader*>(pos)->size;
+        }
+
+        fSubTileOffsets[requestedTile] = offsets;
+    }
+
+    // Position in the file and size of a (sub-)tile, if known without reading it
+    bool GetTileLocation(int64_t requestedTile, int64_t &pos, size_t &size)
+    {
+        const int64_t requestedSuperTile = requestedTile / fShrinkFactor;
+        const int64_t requestedSubTile   = requestedTile % fShrinkFactor;
+
+        if (requestedSubTile==0)
+        {
+            pos  = fHeapOff + fCatalog[requestedSuperTile][0].second - sizeof(FITS::TileHeader);
+            size = fTileSize[requestedSuperTile] + sizeof(FITS::TileHeader);
+            return true;
+        }
+
+        // The sub-tiles follow each other
+        const std::vector<int64_t> &index = GetSubTileIndex();
+        if (size_t(requestedTile+1)>=index.size())
+            return false;
+
+        pos  = fHeapOff + index[requestedTile];
+        size = index[requestedTile+1] - index[requestedTile];
+        return true;
+    }
+
+    // Read the requested (sub-)tile from disk into the compressed buffer of tile.
+    // A tile read aside, e.g. for FetchRows, is not part of the sequence of
+    // tiles read: neither the checksum nor the copy of the file are updated.
+    void ReadTile(Tile &tile, int64_t requestedTile, bool aside=false)
+    {
+        const int64_t requestedSuperTile = requestedTile / fShrinkFactor;
+        const int64_t requestedSubTile   = requestedTile % fShrinkFactor;
+
+        // Is this just the next tile in the sequence?
+        const bool isNextTile = !aside && requestedTile==fLastTileRead+1;
+
+        //skip to the beginning of the tile
+        const int64_t superTileStart = fCatalog[requestedSuperTile][0].second - sizeof(FITS::TileHeader);
+
+        tile.offsets = fTileOffsets[requestedSuperTile];
+
+        // If this is a sub tile we have to look up where it starts.
+        // If we were just reading the previous one we can skip that.
+        if (!isNextTile || fLastTileRead<0)
+        {
+            if (requestedSubTile>0)
+                seekg(fHeapOff+GetSubTileIndex()[requestedTile]);
+            else
+                seekg(fHeapOff+superTileStart);
+        }
+
+        // this is now the beginning of the sub-tile we want to read
+        const int64_t subTileStart = tellg() - fHeapOff;
+        // calculate the 32 bits offset of the current tile.
+        const uint32_t offset = (subTileStart + fHeapFromDataStart)%4;
+
+        // If the backend holds the file in memory, the tile is used
+        // where it is instead of being copied to the compressed buffer
+        const char *mapped = fBackend ? fBackend->Map(tellg(), sizeof(FITS::TileHeader)) : NULL;
+
+        // start of destination buffer (padding comes later)
+        char *destBuffer = tile.compressed.data()+offset;
+
+        // Get size of tile. For sub tiles it is only known from the header.
+        size_t currentTileSize = fTileSize[requestedSuperTile] + sizeof(FITS::TileHeader);
+        if (requestedSubTile>0)
+        {
+            if (!mapped)
+                read(destBuffer, sizeof(FITS::TileHeader));
+
+            currentTileSize = reinterpret_cast<const FITS::TileHeader*>(mapped ? mapped : destBuffer)->size;
+        }
+
+        if (mapped)
+        {
+            const char *tileData = fBackend->Map(tellg(), currentTileSize);
+
+            // Truncated file: fall back to reading what is there
+            if (!tileData && requestedSubTile>0)
+            {
+                memcpy(destBuffer, mapped, sizeof(FITS::TileHeader));
+                seekg(sizeof(FITS::TileHeader), cur);
+            }
+
+            mapped = tileData;
+        }
+
+        if (mapped)
+        {
+            tile.data = mapped;
+            seekg(currentTileSize, cur);
+        }
+        else
+        {
+            tile.data = destBuffer;
+
+            // now read the remaining bytes of this tile
+            if (requestedSubTile>0)
+                read(destBuffer+sizeof(FITS::TileHeader), currentTileSize-sizeof(FITS::TileHeader));
+            else
+                read(destBuffer, currentTileSize);
+        }
+
+        // If this is a request for a sub tile which is not cataloged
+        // recalculate the offsets from the buffer, once read
+        if (requestedSubTile>0)
+            GetSubTileOffsets(tile, requestedTile);
+
+        // If we are reading sequentially, calcualte checksum
+        if (isNextTile)
+            AddToChecksum(fChkData, tile.data, currentTileSize, offset);
+
+        tile.index    = requestedTile;
+        tile.offset   = offset;
+        tile.required = GetRequiredColumns();
+        tile.numRows = std::min<size_t>(fNumRowsPerTile, GetNumRows()-requestedTile*fNumRowsPerTile);
+
+        if (aside)
+            return;
+
+        // Check if we are writing a copy of the file
+        if (isNextTile && fCopy.is_open() && fCopy.good())
+        {
+            fCopy.write(tile.data, currentTileSize);
+            if (!fCopy)
+                clear(rdstate()|std::ios::badbit);
+        }
+        else
+            if (fCopy.is_open())
+                clear(rdstate()|std::ios::badbit);
+
+        fLastTileRead = requestedTile;
+    }
+
+    // Uncompress a tile which was read from disk. This does not touch the
+    // state of the stream, so that it can safely run in a worker thread.
+    void UncompressTile(Tile &tile)
+    {
+        UncompressBuffer(tile);
+
+        const uint32_t thisRoundNumRows = tile.numRows;
+
+        // pointer to column (source buffer)
+        const char *src = tile.transposed.data();
+
+        uint32_t i=0;
+        for (auto it=fTable.sorted_cols.cbegin(); it!=fTable.sorted_cols.cend(); it++, i++)
+        {
+            // Column was not uncompressed, see UncompressBuffer
+            if (!tile.required[i])
+            {
+                src += it->bytes*thisRoundNumRows;
+                continue;
+            }
+
+            char *buffer = tile.buffer.data() + it->offset; // pointer to column (destination buffer)
+
+            switch (tile.ordering[i])
+            {
+            case FITS::kOrderByRow:
+                // regular, "semi-transposed" copy
+                for (char *dest=buffer; dest<buffer+thisRoundNumRows*fTable.bytes_per_row; dest+=fTable.bytes_per_row) // row-by-row
+                {
+                    memcpy(dest, src, it->bytes);
+                    src += it->bytes;  // next column
+                }
+                break;
+
+            case FITS::kOrderByCol:
+                // transposed copy
+                for (char *elem=buffer; elem<buffer+it->bytes; elem+=it->size) // element-by-element (arrays)
+                {
+                    for (char *dest=elem; dest<elem+thisRoundNumRows*fTable.bytes_per_row; dest+=fTable.bytes_per_row) // row-by-row
+                    {
+                            memcpy(dest, src, it->size);
+                            src += it->size; // next element
+                    }
+                }
+                break;
+
+            default:
+                std::ostringstream str;
+                str << "Unkown column ordering scheme found (i=" << i << ", " << tile.ordering[i] << ")";
+                throw std::runtime_error(str.str());
+            };
+        }
+    }
+
+    // Get the requested tile from the read-ahead queue and queue the
+    // following tiles for uncompression
+    void ReadAheadTile(int64_t requestedTile)
+    {
+        // This is not a sequential read: what is queued is useless
+        if (!fReadAhead.empty() && fReadAhead.front()->index!=requestedTile)
+            FlushReadAhead();
+
+        const int64_t numTiles = GetNumTiles();
+
+        int64_t nextTile = fReadAhead.empty() ? requestedTile : fReadAhead.back()->index+1;
+        while (fReadAhead.size()<=fReadAheadDepth && nextTile<numTiles)
+        {
+            std::unique_ptr<Tile> tile = GetFreeTile();
+
+            ReadTile(*tile, nextTile++);
+
+            Tile *ptr = tile.get();
+            tile->ready = fThreads.Submit([this, ptr]() { UncompressTile(*ptr); });
+
+            fReadAhead.push_back(std::move(tile));
+        }
+
+        std::unique_ptr<Tile> tile = std::move(fReadAhead.front());
+        fReadAhead.pop_front();
+
+        try
+        {
+            tile->ready.get();
+        }
+        catch (...)
+        {
+            fFreeTiles.push_back(std::move(tile));
+            FlushReadAhead();
+
+            clear(rdstate()|std::ios::badbit);
+            throw;
+        }
+
+        AddCurrentTileToCache();
+
+        std::swap(fTile, *tile);
+        fFreeTiles.push_back(std::move(tile));
+    }
+
+    // Tiles of FetchRows being read or uncompressed
+    struct FetchState
+    {
+        size_t depth; ///< maximum number of tiles in flight
+        int    fd;    ///< file descriptor to read from, -1 if not yet opened
+        bool   owned; ///< fd was opened for FetchRows
+
+        std::unique_ptr<AsyncReader>                            reader;
+        std::unordered_map<uint64_t, std::unique_ptr<Tile>>    reading;  ///< tiles being read, by their index in the list of tiles
+        std::deque<std::pair<size_t, std::unique_ptr<Tile>>>   decoding; ///< tiles being uncompressed, with their index in the list of tiles
+
+        FetchState(size_t d) : depth(d), fd(-1), owned(false) { }
+
+        ~FetchState()
+        {
+            reader.reset();
+            if (owned)
+                ::close(fd);
+        }
+    };
+
+    // Read and uncompress the tiles of FetchRows and copy the requested rows
+    void FetchTiles(FetchState &state, const std::vector<std::pair<int64_t, std::vector<size_t>>> &list,
+                    const std::vector<size_t> &rows, const Addresses &addresses)
+    {
+        size_t next      = 0;
+        size_t delivered = 0;
+
+        while (delivered<list.size())
+        {
+            // Start as many reads as the queue takes
+            while (next<list.size() && state.reading.size()+state.decoding.size()<state.depth)
+            {
+                const int64_t requestedTile = list[next].first;
+
+                std::unique_ptr<Tile> tile = GetFreeTile();
+
+                tile->index    = requestedTile;
+                tile->numRows  = std::min<size_t>(fNumRowsPerTile, GetNumRows()-requestedTile*fNumRowsPerTile);
+                tile->offsets  = fTileOffsets[requestedTile/fShrinkFactor];
+                tile->required = fRequired;
+
+                int64_t pos  = 0;
+                size_t  size = 0;
+
+                const bool located = GetTileLocation(requestedTile, pos, size);
+
+                // The backend has the data in memory
+                const char *mapped = located && fBackend ? fBackend->Map(pos, size) : NULL;
+                if (mapped)
+                {
+                    tile->data = mapped;
+                    StartUncompressing(state, next++, tile);
+                    continue;
+                }
+
+                if (located && state.fd<0 && !state.owned)
+                {
+                    // Only the plain file can be read by name, not e.g. a gzip compressed one
+                    state.fd = fBackend ? fBackend->GetFileDescriptor() : -1;
+                    if (state.fd<0 && !fBackend && !fFileName.empty())
+                    {
+                        state.fd    = ::open(fFileName.c_str(), O_RDONLY);
+                        state.owned = state.fd>=0;
+                    }
+                }
+
+                // No way to read it on the side: read it through the
+                // stream, which is put back where it was afterwards
+                if (!located || state.fd<0)
+                {
+                    const std::streampos where = tellg();
+
+                    ReadTile(*tile, requestedTile, true);
+                    seekg(where);
+
+                    if (!good())
+                    {
+                        fFreeTiles.push_back(std::move(tile));
+                        throw std::runtime_error("Reading a tile failed.");
+                    }
+
+                    StartUncompressing(state, next++, tile);
+                    continue;
+                }
+
+                if (!state.reader)
+                    state.reader.reset(new AsyncReader(state.depth));
+
+                // Keep the 32 bits alignment of the tile as for ReadTile
+                const uint32_t offset = (pos - fHeapOff + fHeapFromDataStart)%4;
+
+                char *dest = tile->compressed.data()+offset;
+
+                tile->offset = offset;
+                tile->data   = dest;
+
+                state.reader->Submit(next, state.fd, pos, dest, size);
+                state.reading[next++] = std::move(tile);
+            }
+
+            // Wait for a read, unless an uncompressed tile is ready
+            if (!state.reading.empty() && (state.decoding.empty() || !IsTileReady(*state.decoding.front().second)))
+            {
+                AsyncReader::Result res;
+                if (!state.reader->Wait(res))
+                    throw std::runtime_error("Waiting for the reads of tiles failed.");
+
+                std::unique_ptr<Tile> tile = std::move(state.reading[res.id]);
+                state.reading.erase(res.id);
+
+                int64_t pos  = 0;
+                size_t  size = 0;
+                GetTileLocation(tile->index, pos, size);
+
+                if (res.result!=ssize_t(size))
+                {
+                    fFreeTiles.push_back(std::move(tile));
+                    throw std::runtime_error("Reading a tile failed.");
+                }
+
+                StartUncompressing(state, res.id, tile);
+                continue;
+            }
+
+            if (state.decoding.empty())
+                continue;
+
+            // Hand the rows of the next uncompressed tile to the user
+            std::unique_ptr<Tile> tile = std::move(state.decoding.front().second);
+            const size_t idx = state.decoding.front().first;
+            state.decoding.pop_front();
+
+            if (tile->ready.valid())
+            {
+                try
+                {
+                    tile->ready.get();
+                }
+                catch (...)
+                {
+                    fFreeTiles.push_back(std::move(tile));
+                    throw;
+                }
+            }
+
+            CopyFetchedRows(*tile, list[idx].second, rows, addresses);
+            fFreeTiles.push_back(std::move(tile));
+
+            delivered++;
+        }
+    }
+
+    // Uncompress a tile read by FetchTiles, by a worker if there are any
+    void StartUncompressing(FetchState &state, size_t idx, std::unique_ptr<Tile> &tile)
+    {
+        if (tile->index%fShrinkFactor>0)
+            GetSubTileOffsets(*tile, tile->index);
+
+        if (fThreads.GetNumThreads()>0)
+        {
+            Tile *ptr = tile.get();
+            tile->ready = fThreads.Submit([this, ptr]() { UncompressTile(*ptr); });
+        }
+        else
+        {
+            try
+            {
+                UncompressTile(*tile);
+            }
+            catch (...)
+            {
+                fFreeTiles.push_back(std::move(tile));
+                throw;
+            }
+        }
+
+        state.decoding.emplace_back(idx, std::move(tile));
+    }
+
+    static bool IsTileReady(const Tile &tile)
+    {
+        return !tile.ready.valid() || tile.ready.wait_for(std::chrono::seconds(0))==std::future_status::ready;
+    }
+
+    // Copy the rows requested from tile (indices into rows) to the users' arrays
+    void CopyFetchedRows(const Tile &tile, const std::vector<size_t> &indices,
+                         const std::vector<size_t> &rows, const Addresses &addresses)
+    {
+        const size_t bytesPerRow = fTable.bytes_per_row;
+
+        fBufferRows.resize(bytesPerRow);
+
+        for (auto it=indices.cbegin(); it!=indices.cend(); it++)
+        {
+            const size_t row = rows[*it];
+
+            memcpy(fBufferRows.data(), tile.buffer.data()+(row%fNumRowsPerTile)*bytesPerRow, bytesPerRow);
+
+            ProcessRows(fBufferRows.data(), 1);
+
+            for (auto ia=addresses.cbegin(); ia!=addresses.cend(); ia++)
+            {
+                const Table::Column &c = ia->second;
+                MoveColumnDataToUserSpace(reinterpret_cast<char*>(ia->first) + *it*c.bytes, fBufferRows.data()+c.offset, c);
+            }
+        }
+    }
+
+    // Wait for all queued tiles and return them to the list of spare tiles
+    void FlushReadAhead()
+    {
+        for (auto it=fReadAhead.begin(); it!=fReadAhead.end(); it++)
+        {
+            if ((*it)->ready.valid())
+                (*it)->ready.wait();
+
+            fFreeTiles.push_back(std::move(*it));
+        }
+
+        fReadAhead.clear();
+    }
+
+    // Read a bunch of uncompressed data
+    uint32_t UncompressUNCOMPRESSED(char*       dest,
+                                    const char* src,
+                                    uint32_t    numElems,
+                                    uint32_t    sizeOfElems)
+    {
+        memcpy(dest, src, numElems*sizeOfElems);
+        return numElems*sizeOfElems;
+    }
+
+    // Output of the Huffman decoder which undoes the integer smoothing
+    // on the fly, see UnApplySMOOTHING. Keeps its state from chunk to chunk.
+    struct UnsmoothingOutput
+    {
+        int16_t  prev[2]; ///< the last two values written
+        uint32_t skip;    ///< number of values still to be written unchanged
+
+        UnsmoothingOutput() : skip(2) { prev[0] = prev[1] = 0; }
+
+        void operator()(uint16_t *out, uint16_t symbol)
+        {
+            int16_t value = symbol;
+            if (skip)
+                skip--;
+            else
+                value = value + (prev[0]+prev[1])/2;
+
+            *reinterpret_cast<int16_t*>(out) = value;
+
+            prev[1] = prev[0];
+            prev[0] = value;
+        }
+
+        void operator()(uint16_t *out, const uint16_t *symbols, uint8_t count)
+        {
+            for (uint8_t i=0; i<count; i++)
+                (*this)(out+i, symbols[i]);
+        }
+    };
+
+    // Read a bunch of data compressed with the Huffman algorithm. The
+    // decoder is a Huffman::Decoder for kFactHuffman16 or a
+    // Huffman::CanonicalDecoder for kFactHuffman16Canonical. The chunks
+    // of kFactTANS16 are framed the same, its TANS::Decoder is used alike.
+    // length is the number of bytes of the column block from src on.
+    template<class Decoder_t, class Output>
+    uint32_t UncompressHUFFMAN16(char*       dest,
+                                 const char* src,
+                                 size_t      length,
+                                 uint32_t    numChunks,
+                                 size_t      capacity,
+                                 Decoder_t  &decoder,
+                                 Output     &output)
+    {
+        if (numChunks > length/sizeof(uint32_t))
+            throw std::runtime_error("Huffman compressed sizes exceed the size of the column block.");
+
+        //read compressed sizes (one per row)
+        const uint32_t* compressedSizes = reinterpret_cast<const uint32_t*>(src);
+        src    += sizeof(uint32_t)*numChunks;
+        length -= sizeof(uint32_t)*numChunks;
+
+        //uncompress the rows, one by one, directly into the destination
+        uint32_t sizeWritten = 0;
+        for (uint32_t j=0;j<numChunks;j++)
+        {
+            if (compressedSizes[j] > length)
+                throw std::runtime_error("Huffman coded chunk exceeds the size of the column block.");
+
+            size_t numDecoded = 0;
+            Huffman::Decode(reinterpret_cast<const unsigned char*>(src), compressedSizes[j],
+                            reinterpret_cast<uint16_t*>(dest), (capacity-sizeWritten)/sizeof(uint16_t),
+                            numDecoded, decoder, output);
+
+            sizeWritten += numDecoded*sizeof(uint16_t);
+            dest        += numDecoded*sizeof(uint16_t);
+            src         += compressedSizes[j];
+            length      -= compressedSizes[j];
+        }
+        return sizeWritten;
+    }
+
+    // length is the number of bytes of the column block from src on
+    template<class Decoder_t>
+    uint32_t UncompressHUFFMAN16(char*       dest,
+                                 const char* src,
+                                 size_t      length,
+                                 uint32_t    numChunks,
+                                 size_t      capacity,
+                                 std::vector<Decoder_t> &decoders)
+    {
+        if (IsParallelDecoding(src, length, numChunks))
+            return UncompressHUFFMAN16Parallel(dest, src, length, numChunks, capacity, decoders);
+
+        Huffman::Store store;
+        return UncompressHUFFMAN16(dest, src, length, numChunks, capacity, decoders[0], store);
+    }
+
+    // Smoothing followed by Huffman coding is what is used for the
+    // bulk of the data. Undo both in one pass over the data.
+    template<class Decoder_t>
+    uint32_t UncompressSMOOTHEDHUFFMAN16(char*       dest,
+                                         const char* src,
+                                         size_t      length,
+                                         uint32_t    numChunks,
+                                         size_t      capacity,
+                                         std::vector<Decoder_t> &decoders)
+    {
+        // The smoothing runs across the chunks. If they are decoded
+        // in parallel, it has to be undone afterwards.
+        if (IsParallelDecoding(src, length, numChunks))
+        {
+            const uint32_t sizeWritten = UncompressHUFFMAN16Parallel(dest, src, length, numChunks, capacity, decoders);
+            return UnApplySMOOTHING(reinterpret_cast<int16_t*>(dest), sizeWritten/sizeof(uint16_t));
+        }
+
+        UnsmoothingOutput unsmoothing;
+        return UncompressHUFFMAN16(dest, src, length, numChunks, capacity, decoders[0], unsmoothing);
+    }
+
+    // Are the chunks worth being split over the decoding workers?
+    bool IsParallelDecoding(const char *src, size_t length, uint32_t numChunks) const
+    {
+        if (fDecodeThreads.GetNumThreads()==0 || numChunks<2)
+            return false;
+
+        // A size table exceeding the block is reported by the serial decoder
+        if (numChunks > length/sizeof(uint32_t))
+            return false;
+
+        const uint32_t* compressedSizes = reinterpret_cast<const uint32_t*>(src);
+
+        size_t total = 0;
+        for (uint32_t j=0; j<numChunks; j++)
+            total += compressedSizes[j];
+
+        return total>=2*fMinRangeSize;
+    }
+
+    // Decode the chunks [first, last) which start at src and are written
+    // to dest. The compressed sizes and the capacity, the room in dest
+    // up to the next range, were already checked against the block.
+    template<class Decoder_t>
+    void DecodeHUFFMAN16Range(char *dest, const char *src, const uint32_t *compressedSizes,
+                              uint32_t first, uint32_t last, size_t capacity, Decoder_t &decoder)
+    {
+        Huffman::Store store;
+
+        size_t sizeWritten = 0;
+        for (uint32_t j=first; j<last; j++)
+        {
+            size_t numDecoded = 0;
+            Huffman::Decode(reinterpret_cast<const unsigned char*>(src), compressedSizes[j],
+                            reinterpret_cast<uint16_t*>(dest), (capacity-sizeWritten)/sizeof(uint16_t),
+                            numDecoded, decoder, store);
+
+            sizeWritten += numDecoded*sizeof(uint16_t);
+            dest        += numDecoded*sizeof(uint16_t);
+            src         += compressedSizes[j];
+        }
+    }
+
+    // The chunks are coded independently, each with its own code table.
+    // Where each one starts in the source and in the destination follows
+    // from the compressed sizes and from the number of symbols stored at
+    // the beginning of each chunk. The chunks are split into ranges of
+    // about the same compressed size, which are decoded by the workers
+    // and by the caller, each with its own decoder.
+    template<class Decoder_t>
+    uint32_t UncompressHUFFMAN16Parallel(char*       dest,
+                                         const char* src,
+                                         size_t      length,
+                                         uint32_t    numChunks,
+                                         size_t      capacity,
+                                         std::vector<Decoder_t> &decoders)
+    {
+        const uint32_t* compressedSizes = reinterpret_cast<const uint32_t*>(src);
+        src    += sizeof(uint32_t)*numChunks;
+        length -= sizeof(uint32_t)*numChunks;
+
+        size_t total = 0;
+        for (uint32_t j=0; j<numChunks; j++)
+            total += compressedSizes[j];
+
+        const size_t numRanges = std::min<size_t>({ fDecodeThreads.GetNumThreads()+1, numChunks, std::max<size_t>(total/fMinRangeSize, 1) });
+
+        if (decoders.size()<numRanges)
+            decoders.resize(numRanges);
+
+        struct Range
+        {
+            uint32_t    first;
+            const char *src;
+            char       *dest;
+        };
+
+        std::vector<Range> ranges;
+        ranges.reserve(numRanges+1);
+
+        // Find the beginning of the ranges
+        size_t compressed   = 0;
+        size_t uncompressed = 0;
+        for (uint32_t j=0; j<numChunks; j++)
+        {
+            if (ranges.size()<numRanges && compressed*numRanges >= ranges.size()*total)
+            {
+                const Range r = { j, src+compressed, dest+uncompressed };
+                ranges.push_back(r);
+            }
+
+            if (compressedSizes[j]<sizeof(size_t))
+                throw std::runtime_error("Huffman coded chunk too short to hold its number of symbols.");
+
+            if (compressedSizes[j] > length-compressed)
+                throw std::runtime_error("Huffman coded chunk exceeds the size of the column block.");
+
+            size_t numSymbols = 0;
+            memcpy(&numSymbols, src+compressed, sizeof(size_t));
+
+            if (numSymbols > (capacity-uncompressed)/sizeof(uint16_t))
+                throw std::runtime_error("Huffman coded chunk exceeds the size of the output buffer.");
+
+            compressed   += compressedSizes[j];
+            uncompressed += numSymbols*sizeof(uint16_t);
+        }
+
+        const Range end = { numChunks, src+compressed, dest+uncompressed };
+        ranges.push_back(end);
+
+        // The caller decodes the first range itself
+        std::vector<std::future<void>> done;
+        for (size_t r=1; r<ranges.size()-1; r++)
+        {
+            const Range &beg = ranges[r];
+            const Range &nxt = ranges[r+1];
+
+            Decoder_t *decoder = &decoders[r];
+            done.push_back(fDecodeThreads.Submit([=]()
+            {
+                DecodeHUFFMAN16Range(beg.dest, beg.src, compressedSizes, beg.first, nxt.first, nxt.dest-beg.dest, *decoder);
+            }));
+        }
+
+        // The workers write to dest until they are finished, even if one fails
+        try
+        {
+            DecodeHUFFMAN16Range(ranges[0].dest, ranges[0].src, compressedSizes, 0, ranges[1].first, ranges[1].dest-ranges[0].dest, decoders[0]);
+        }
+        catch (...)
+        {
+            for (auto it=done.begin(); it!=done.end(); it++)
+                it->wait();
+            throw;
+        }
+
+        for (auto it=done.begin(); it!=done.end(); it++)
+            it->wait();
+        for (auto it=done.begin(); it!=done.end(); it++)
+            it->get();
+
+        return uncompressed;
+    }
+
+    // Apply the inverse transform of the integer smoothing
+    uint32_t UnApplySMOOTHING(int16_t*   data,
+                              uint32_t   numElems)
+    {
+        //un-do the integer smoothing
         for (uint32_t j=2;j<numElems;j++)
             data[j] = data[j] + (data[j-1]+data[j-2])/2;
 
@@ -478,11 +1815,14 @@ private:
     }
 
     // Data has been read from disk. Uncompress it !
-    bool UncompressBuffer(const std::vector<size_t> &offsets,
-                          const uint32_t &thisRoundNumRows,
-                          const uint32_t offset)
+    // If columns is given, each column is uncompressed to the address
+    // columns[i] instead of to the transposed buffer of the tile.
+    bool UncompressBuffer(Tile &tile, const std::vector<char*> *columns=NULL)
     {
-        char *dest = fTransposedBuffer.data();
+        const uint32_t thisRoundNumRows = tile.numRows;
+        const uint32_t offset           = sizeof(FITS::TileHeader);
+
+        char *dest = tile.transposed.data();
 
         //uncompress column by column
         for (uint32_t i=0; i<fTable.sorted_cols.size(); i++)
@@ -491,17 +1831,57 @@ private:
             if (col.num == 0)
                 continue;
 
+            // Not requested: skip it, but keep its space in the transposed buffer
+            if (!tile.required[i])
+            {
+                if (!columns)
+                    dest += col.bytes*thisRoundNumRows;
+                continue;
+            }
+
             //get the compression flag
-            const int64_t compressedOffset = offsets[i]+offset;
+            const int64_t compressedOffset = tile.offsets[i]+offset;
 
-            const FITS::BlockHeader* head = reinterpret_cast<FITS::BlockHeader*>(&fCompressedBuffer[compressedOffset]);
+            const FITS::BlockHeader* head = reinterpret_cast<const FITS::BlockHeader*>(tile.data+compressedOffset);
 
-            fColumnOrdering[i] = head->ordering;
+            tile.ordering[i] = head->ordering;
 
             const uint32_t numRows = (head->ordering==FITS::kOrderByRow) ? thisRoundNumRows : col.num;
             const uint32_t numCols = (head->ordering==FITS::kOrderByCol) ? thisRoundNumRows : col.num;
 
-            const char *src = fCompressedBuffer.data()+compressedOffset+sizeof(FITS::BlockHeader)+sizeof(uint16_t)*head->numProcs;
+            const size_t headerSize = sizeof(FITS::BlockHeader)+sizeof(uint16_t)*head->numProcs;
+            if (head->size<headerSize)
+                throw std::runtime_error("Column block shorter than its header.");
+
+            const char  *src    = tile.data+compressedOffset+headerSize;
+            const size_t length = head->size-headerSize;
+
+            if (columns)
+                dest = (*columns)[i];
+
+            // room left in the destination
+            const size_t capacity = columns ? col.bytes*thisRoundNumRows : tile.transposed.data()+tile.transposed.size()-dest;
+
+            if (head->numProcs==2 && head->processings[0]==FITS::kFactSmoothing)
+            {
+                if (head->processings[1]==FITS::kFactHuffman16)
+                {
+                    dest += UncompressSMOOTHEDHUFFMAN16(dest, src, length, numRows, capacity, tile.decoders);
+                    continue;
+                }
+
+                if (head->processings[1]==FITS::kFactHuffman16Canonical)
+                {
+                    dest += UncompressSMOOTHEDHUFFMAN16(dest, src, length, numRows, capacity, tile.canonicals);
+                    continue;
+                }
+
+                if (head->processings[1]==FITS::kFactTANS16)
+                {
+                    dest += UncompressSMOOTHEDHUFFMAN16(dest, src, length, numRows, capacity, tile.ansDecoders);
+                    continue;
+                }
+            }
 
             for (int32_t j=head->numProcs-1;j >= 0; j--)
             {
@@ -518,12 +1898,18 @@ private:
                     break;
 
                 case FITS::kFactHuffman16:
-                    sizeWritten = UncompressHUFFMAN16(dest, src, numRows);
+                    sizeWritten = UncompressHUFFMAN16(dest, src, length, numRows, capacity, tile.decoders);
                     break;
 
-                default:
-                    clear(rdstate()|std::ios::badbit);
+                case FITS::kFactHuffman16Canonical:
+                    sizeWritten = UncompressHUFFMAN16(dest, src, length, numRows, capacity, tile.canonicals);
+                    break;
+
+                case FITS::kFactTANS16:
+                    sizeWritten = UncompressHUFFMAN16(dest, src, length, numRows, capacity, tile.ansDecoders);
+                    break;
 
+                default:
                     std::ostringstream str;
                     str << "Unknown processing applied to data (col=" << i << ", proc=" << j << "/" << (int)head->numProcs;
                     throw std::runtime_error(str.str());
@@ -537,75 +1923,166 @@ private:
         return true;
     }
 
-    void CheckIfFileIsConsistent(bool update_catalog=false)
+    // Pointer to len bytes at position pos of the heap, or NULL if the
+    // file ends before. The heap is read in large blocks, which are kept
+    // in block; blockStart is the position of the block in the heap.
+    // Positions must not decrease from call to call.
+    const char *ReadHeap(std::vector<char> &block, std::streamoff &blockStart, std::streamoff pos, size_t len)
     {
-        //goto start of heap
-        const streamoff whereAreWe = tellg();
-        seekg(fHeapOff);
+        if (fBackend)
+        {
+            const char *mapped = fBackend->Map(fHeapOff+pos, len);
+            if (mapped)
+                return mapped;
+        }
 
-        //init number of rows to zero
-        uint64_t numRows = 0;
+        const std::streamoff blockEnd = blockStart+block.size();
+        if (pos>=blockStart && pos+std::streamoff(len)<=blockEnd)
+            return block.data()+(pos-blockStart);
+
+        // Keep what is still needed, continue reading behind it
+        const size_t keep = pos<blockEnd ? blockEnd-pos : 0;
+        if (keep>0)
+            memmove(block.data(), block.data()+(pos-blockStart), keep);
+
+        if (keep==0 && pos!=blockEnd)
+            seekg(fHeapOff+pos);
+
+        blockStart = pos;
+
+        block.resize(std::max<size_t>(len, kHeapBlockSize));
+        read(block.data()+keep, block.size()-keep);
+        block.resize(keep+gcount());
+
+        return block.size()>=len ? block.data() : NULL;
+    }
+
+    // Walk through the heap in large sequential blocks and catalog all
+    // tiles up to the first which is incomplete or corrupt. Positions are
+    // counted from the start of the heap, as in the catalog of the file.
+    // If tileRows is given, the number of rows of each tile is added.
+    uint64_t ScanHeap(std::vector<std::vector<std::pair<int64_t, int64_t>>> &catalog, std::vector<uint32_t> *tileRows=NULL)
+    {
+        const std::streamoff whereAreWe = tellg();
 
-        //get number of columns from header
         const size_t numCols = fTable.num_cols;
 
-        std::vector<std::vector<std::pair<int64_t, int64_t> > > catalog;
+        std::vector<char> block;
+        std::streamoff blockStart = 0;
 
-        FITS::TileHeader tileHead;
-        FITS::BlockHeader columnHead;
+        // No tile can be larger than what is left of the file
+        seekg(0, end);
+        const std::streamoff heapSize = std::streamoff(tellg())-fHeapOff;
 
-        streamoff offsetInHeap = 0;
-        //skip through the heap
-        while (true)
+        seekg(fHeapOff);
+
+        uint64_t numRows = 0;
+
+        std::streamoff pos = 0;
+        while (1)
         {
-            read((char*)(&tileHead), sizeof(FITS::TileHeader));
-            //end of file
-            if (!good())
+            const char *ptr = ReadHeap(block, blockStart, pos, sizeof(FITS::TileHeader));
+            if (!ptr)
                 break;
 
+            FITS::TileHeader tileHead;
+            memcpy(&tileHead, ptr, sizeof(FITS::TileHeader));
+
             //padding or corrupt data
-            if (memcmp(tileHead.id, "TILE", 4))
-            {
-                clear(rdstate()|std::ios::badbit);
+            if (memcmp(tileHead.id, "TILE", 4) || tileHead.size<sizeof(FITS::TileHeader) || tileHead.size>uint64_t(heapSize-pos))
                 break;
-            }
 
-            //a new tile begins here
-            catalog.emplace_back();
-            offsetInHeap += sizeof(FITS::TileHeader);
+            //incomplete tile
+            ptr = ReadHeap(block, blockStart, pos, tileHead.size);
+            if (!ptr)
+                break;
+
+            const std::streamoff tileEnd = pos+tileHead.size;
 
-            //skip through the columns
-            for (size_t i=0;i<numCols;i++)
+            std::vector<std::pair<int64_t, int64_t>> tile;
+
+            std::streamoff offsetInHeap = pos+sizeof(FITS::TileHeader);
+            for (size_t i=0; i<numCols; i++)
             {
-                //zero sized column do not have headers. Skip it
+                //zero sized column do not have headers
                 if (fTable.sorted_cols[i].num == 0)
                 {
-                    catalog.back().emplace_back(0,0);
+                    tile.emplace_back(0, 0);
                     continue;
                 }
 
-                //read column header
-                read((char*)(&columnHead), sizeof(FITS::BlockHeader));
-
-                //corrupted tile
-                if (!good())
+                if (offsetInHeap+std::streamoff(sizeof(FITS::BlockHeader))>tileEnd)
                     break;
 
-                catalog.back().emplace_back((int64_t)(columnHead.size),offsetInHeap);
+                FITS::BlockHeader columnHead;
+                memcpy(&columnHead, ptr+(offsetInHeap-pos), sizeof(FITS::BlockHeader));
+
+                tile.emplace_back(int64_t(columnHead.size), offsetInHeap);
                 offsetInHeap += columnHead.size;
-                seekg(fHeapOff+offsetInHeap);
             }
 
-            //if we ain't good, this means that something went wrong inside the current tile.
-            if (!good())
+            //the columns must fill the tile exactly
+            if (tile.size()!=numCols || offsetInHeap!=tileEnd)
+                break;
+
+            catalog.push_back(tile);
+            numRows += tileHead.numRows;
+
+            if (tileRows)
+                tileRows->push_back(tileHead.numRows);
+
+            pos = tileEnd;
+        }
+
+        //clear the bad bit before seeking back (we hit eof)
+        clear();
+        seekg(whereAreWe);
+
+        return numRows;
+    }
+
+    // Replace the catalog by the tiles found in the heap. Every (sub-)tile
+    // gets an entry and the number of rows is set to the rows found.
+    void RebuildCatalog()
+    {
+        std::vector<std::vector<std::pair<int64_t, int64_t>>> catalog;
+        std::vector<uint32_t> tileRows;
+        ScanHeap(catalog, &tileRows);
+
+        // The heap holds each sub-tile with its own header
+        fShrinkFactor = 1;
+
+        // Rows are found in the tiles by their index: all but the
+        // last tile must be full
+        uint64_t numRows = 0;
+        for (size_t i=0; i<catalog.size(); i++)
+        {
+            if (tileRows[i]>fNumRowsPerTile || numRows%fNumRowsPerTile!=0)
             {
-                catalog.pop_back();
+                catalog.resize(i);
                 break;
             }
-            //current tile is complete. Add rows
-            numRows += tileHead.numRows;
+
+            numRows += tileRows[i];
         }
 
+        fCatalog  = catalog;
+        fNumTiles = catalog.size();
+
+        fTable.num_rows = numRows;
+        fTable.keys["ZNAXIS2"].SetValue(std::to_string((long long unsigned int)numRows));
+    }
+
+    void CheckIfFileIsConsistent(bool update_catalog=false)
+    {
+        //get number of columns from header
+        const size_t numCols = fTable.num_cols;
+
+        std::vector<std::vector<std::pair<int64_t, int64_t> > > catalog;
+
+        //skip through the heap
+        const uint64_t numRows = ScanHeap(catalog);
+
         if (numRows != fTable.num_rows)
         {
             clear(rdstate()|std::ios::badbit);
@@ -617,9 +2094,6 @@ private:
         if (update_catalog)
         {
             fCatalog = catalog;
-            //clear the bad bit before seeking back (we hit eof)
-            clear();
-            seekg(whereAreWe);
             return;
         }
 
@@ -639,10 +2113,6 @@ private:
                     throw std::runtime_error("Heap data does not agree with header.");
                 }
             }
-        //go back to start of heap
-        //clear the bad bit before seeking back (we hit eof)
-        clear();
-        seekg(whereAreWe);
     }
 
 };//class zfits
@@ -0,0 +1,746 @@
+/*
+ * zofits.h
+ *
+ * Writer of FACT compressed fits files as read by zfits. The rows are
+ * collected into tiles, the tiles are compressed by a pool of threads
+ * and written to the heap in order. The catalog, which tells where in
+ * the heap the columns of each tile are, is written when the table is
+ * closed, into space reserved in front of the heap.
+ *
+ */
+
+#ifndef MARS_zofits
+#define MARS_zofits
+
+#include <deque>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+
+#include "FITS.h"
+#include "huffman.h"
+#include "tans.h"
+#include "checksum.h"
+#include "threadpool.h"
+
+class zofits : public std::ofstream
+{
+public:
+    struct Key
+    {
+        std::string key;
+        std::string value;   ///< formatted as it appears in the header
+        std::string comment;
+    };
+
+    struct Column
+    {
+        std::string name;
+        std::string unit;
+        std::string comment;
+        char        type;
+        uint32_t    num;    ///< number of elements
+        uint32_t    size;   ///< size of one element
+        size_t      offset; ///< offset of the column in the row
+
+        FITS::Compression comp;
+    };
+
+private:
+    typedef std::vector<std::pair<int64_t, int64_t>> CatalogRow;
+
+    // All buffers needed to compress one tile
+    struct Tile
+    {
+        uint64_t firstRow;             ///< index of the first row in the table
+        uint32_t numRows;              ///< number of rows in this tile
+        std::vector<char> rows;        ///< rows as given to WriteRow
+        std::vector<char> transposed;  ///< columns one after the other, as ordered in their compression
+        std::vector<char> compressed;  ///< the tile as written to the heap
+        std::string       huffman;     ///< Huffman coded chunks of the current column
+        CatalogRow        catalog;     ///< size and offset from the start of the tile of each column
+        Huffman::Encoder  encoder;     ///< reused for all chunks of the tile
+        TANS::Encoder     ansEncoder;  ///< the same for kFactTANS16
+        Checksum          rawsum;      ///< checksum of the rows
+        std::future<void> ready;       ///< valid while a worker is compressing the tile
+
+        Tile() : firstRow(0), numRows(0) { }
+    };
+
+    std::vector<Key>    fKeys;       ///< keys of the current table set by the user
+    std::vector<Column> fColumns;    ///< columns of the current table
+    std::vector<Key>    fNewKeys;    ///< keys for the next table
+    std::vector<Column> fNewColumns; ///< columns for the next table
+
+    size_t   fBytesPerRow;
+    uint32_t fNumRowsPerTile;
+    uint32_t fMaxCatalogRows; ///< rows of the catalog reserved in front of the heap
+
+    bool           fTableOpen;
+    std::string    fTableName;
+    std::streamoff fTableStart; ///< position of the header of the table
+    std::streamoff fDataStart;  ///< position of the catalog
+    std::streamoff fHeapStart;  ///< position of the heap
+    uint64_t       fHeapSize;   ///< bytes written to the heap
+    uint64_t       fNumRows;    ///< rows written to the heap
+
+    std::vector<CatalogRow> fCatalog; ///< one row per tile, offsets from the start of the heap
+
+    Checksum fDatasum; ///< checksum of catalog and heap, without the catalog until the table is closed
+    Checksum fRawsum;  ///< checksum of the rows as given to WriteRow
+
+    std::unique_ptr<Tile>              fTile;      ///< the tile being filled
+    std::deque<std::unique_ptr<Tile>>  fQueue;     ///< tiles being compressed, in file order
+    std::vector<std::unique_ptr<Tile>> fFreeTiles; ///< spare tiles
+    size_t                             fQueueDepth; ///< number of tiles to keep in flight
+
+    ThreadPool fThreads; ///< workers compressing the tiles, joined before the tiles are destroyed
+
+    void Error(const std::string &txt)
+    {
+        clear(rdstate()|std::ios::badbit);
+        throw std::runtime_error(txt);
+    }
+
+    // A header card of exactly 80 characters
+    static std::string Card(const std::string &key, const std::string &value, const std::string &comment)
+    {
+        std::ostringstream card;
+        card << std::left << std::setw(8) << key << "= " << value;
+        if (!comment.empty())
+            card << " / " << comment;
+
+        std::string rc = card.str();
+        rc.resize(80, ' ');
+        return rc;
+    }
+
+    static std::string FormatStr(const std::string &value)
+    {
+        std::string rc = "'";
+        for (auto it=value.cbegin(); it!=value.cend() && rc.size()<68; it++)
+        {
+            rc += *it;
+            if (*it=='\'')
+                rc += '\'';
+        }
+
+        // Strings are at least eight characters long
+        if (rc.size()<9)
+            rc.resize(9, ' ');
+
+        return rc + "'";
+    }
+
+    // Numbers and booleans end in column 30
+    static std::string FormatValue(const std::string &value)
+    {
+        std::ostringstream str;
+        str << std::right << std::setw(20) << value;
+        return str.str();
+    }
+
+    static void SetKey(std::vector<Key> &keys, const std::string &key, const std::string &value, const std::string &comment)
+    {
+        for (auto it=keys.begin(); it!=keys.end(); it++)
+            if (it->key==key)
+            {
+                it->value   = value;
+                it->comment = comment;
+                return;
+            }
+
+        const Key k = { key, value, comment };
+        keys.push_back(k);
+    }
+
+    void SetUserKey(const std::string &key, const std::string &value, const std::string &comment)
+    {
+        if (key.empty() || key.size()>8)
+            throw std::runtime_error("Invalid key '"+key+"'");
+
+        if (FITS::IsReservedKeyWord(key) || key=="CHECKSUM")
+            throw std::runtime_error("Key '"+key+"' is set by the writer");
+
+        SetKey(fNewKeys, key, value, comment);
+    }
+
+    // Header from the keys, padded to full blocks. The CHECKSUM is
+    // computed such that header and data add up to all ones.
+    static std::string CompileHeader(std::vector<Key> keys, const Checksum &datasum)
+    {
+        SetKey(keys, "CHECKSUM", FormatStr("0000000000000000"), "Checksum for the whole HDU");
+        SetKey(keys, "DATASUM",  FormatStr(std::to_string((long long unsigned int)datasum.val())), "Checksum for the data block");
+
+        std::string header;
+        for (auto it=keys.cbegin(); it!=keys.cend(); it++)
+            header += Card(it->key, it->value, it->comment);
+
+        header += std::string("END").append(77, ' ');
+        header.resize((header.size()+2879)/2880*2880, ' ');
+
+        Checksum sum;
+        sum.add(header.data(), header.size());
+        sum += datasum;
+
+        // Replace the zeros by the checksum
+        const size_t pos = header.find("'0000000000000000'");
+        header.replace(pos+1, 16, sum.str());
+
+        return header;
+    }
+
+    void WritePrimaryHeader()
+    {
+        std::vector<Key> keys;
+        SetKey(keys, "SIMPLE", FormatValue("T"), "file does conform to FITS standard");
+        SetKey(keys, "BITPIX", FormatValue("8"), "number of bits per data pixel");
+        SetKey(keys, "NAXIS",  FormatValue("0"), "number of data axes");
+        SetKey(keys, "EXTEND", FormatValue("T"), "FITS dataset may contain extensions");
+
+        const std::string header = CompileHeader(keys, Checksum());
+        write(header.data(), header.size());
+    }
+
+    // The header of the current table. Before the table is closed, the
+    // values are placeholders of the final ones, so that the header
+    // keeps its size.
+    std::string CompileTableHeader(uint32_t catalogRows, uint32_t shrink) const
+    {
+        std::vector<Key> keys;
+
+        const size_t reserved = size_t(fMaxCatalogRows)*fColumns.size()*2*sizeof(int64_t);
+
+        const double ratio = fHeapSize==0 ? 0 : double(fNumRows*fBytesPerRow)/fHeapSize;
+
+        std::ostringstream zratio;
+        zratio << std::uppercase << std::scientific << std::setprecision(10) << ratio;
+
+        SetKey(keys, "XTENSION", FormatStr("BINTABLE"), "binary table extension");
+        SetKey(keys, "BITPIX",   FormatValue("8"), "8-bit bytes");
+        SetKey(keys, "NAXIS",    FormatValue("2"), "2-dimensional binary table");
+        SetKey(keys, "NAXIS1",   FormatValue(std::to_string((long long unsigned int)fColumns.size()*2*sizeof(int64_t))), "width of table in bytes");
+        SetKey(keys, "NAXIS2",   FormatValue(std::to_string((long long unsigned int)catalogRows)), "number of rows in table");
+        SetKey(keys, "PCOUNT",   FormatValue(std::to_string((long long unsigned int)fHeapSize)), "size of special data area");
+        SetKey(keys, "GCOUNT",   FormatValue("1"), "one data group (required keyword)");
+        SetKey(keys, "TFIELDS",  FormatValue(std::to_string((long long unsigned int)fColumns.size())), "number of fields in each row");
+        SetKey(keys, "EXTNAME",  FormatStr(fTableName), "name of extension table");
+        SetKey(keys, "ZTABLE",   FormatValue("T"), "Table is compressed");
+        SetKey(keys, "ZNAXIS1",  FormatValue(std::to_string((long long unsigned int)fBytesPerRow)), "Width of uncompressed rows");
+        SetKey(keys, "ZNAXIS2",  FormatValue(std::to_string((long long unsigned int)fNumRows)), "Number of uncompressed rows");
+        SetKey(keys, "ZPCOUNT",  FormatValue("0"), "");
+        SetKey(keys, "ZHEAPPTR", FormatValue(std::to_string((long long unsigned int)reserved)), "");
+        SetKey(keys, "ZTILELEN", FormatValue(std::to_string((long long unsigned int)fNumRowsPerTile*shrink)), "Number of rows per tile");
+        SetKey(keys, "ZSHRINK",  FormatValue(std::to_string((long long unsigned int)shrink)), "Catalog shrink factor");
+        SetKey(keys, "THEAP",    FormatValue(std::to_string((long long unsigned int)reserved)), "");
+        SetKey(keys, "RAWSUM",   FormatStr(std::to_string((long long unsigned int)fRawsum.val())), "Checksum of raw little endian data");
+        SetKey(keys, "ZRATIO",   FormatValue(zratio.str()), "Compression ratio");
+
+        for (size_t i=0; i<fColumns.size(); i++)
+        {
+            const Column &col = fColumns[i];
+            const std::string n = std::to_string((long long unsigned int)i+1);
+
+            SetKey(keys, "TTYPE"+n, FormatStr(col.name), col.comment);
+            SetKey(keys, "TFORM"+n, FormatStr("1QB"), "data format of field: variable length");
+            SetKey(keys, "ZFORM"+n, FormatStr(std::to_string((long long unsigned int)col.num)+col.type), FITS::CommentFromType(col.type));
+            SetKey(keys, "ZCTYP"+n, FormatStr("FACT"), "Compression type FACT");
+            if (!col.unit.empty())
+                SetKey(keys, "TUNIT"+n, FormatStr(col.unit), "unit of field");
+        }
+
+        keys.insert(keys.end(), fKeys.begin(), fKeys.end());
+
+        return CompileHeader(keys, fDatasum);
+    }
+
+    void WriteZeros(size_t num)
+    {
+        const std::vector<char> zeros(std::min<size_t>(num, 1<<16));
+        while (num>0)
+        {
+            const size_t n = std::min(num, zeros.size());
+            write(zeros.data(), n);
+            num -= n;
+        }
+    }
+
+    std::unique_ptr<Tile> GetFreeTile()
+    {
+        if (fFreeTiles.empty())
+            return std::unique_ptr<Tile>(new Tile);
+
+        std::unique_ptr<Tile> tile = std::move(fFreeTiles.back());
+        fFreeTiles.pop_back();
+        return tile;
+    }
+
+    // Apply the processings of a column to the transposed data and
+    // append the block to the tile
+    void CompressColumn(Tile &tile, char *src, const Column &col)
+    {
+        const uint32_t numRows  = tile.numRows;
+        const size_t   numBytes = size_t(col.num)*col.size*numRows;
+
+        FITS::Compression comp = col.comp;
+
+        const size_t start = tile.compressed.size();
+        tile.compressed.resize(start+comp.getSizeOnDisk());
+
+        for (uint16_t j=0; j<comp.getNumProcs(); j++)
+        {
+            switch (comp.getProc(j))
+            {
+            case FITS::kFactSmoothing:
+                {
+                    int16_t *data = reinterpret_cast<int16_t*>(src);
+                    for (int64_t k=numBytes/2-1; k>=2; k--)
+                        data[k] = data[k] - (data[k-1]+data[k-2])/2;
+                }
+                break;
+
+            case FITS::kFactHuffman16:
+            case FITS::kFactHuffman16Canonical:
+            case FITS::kFactTANS16:
+                {
+
+                    // One chunk per row or per element
+                    const uint32_t numChunks = comp.getOrdering()==FITS::kOrderByRow ? numRows : col.num;
+                    const size_t   chunkSize = numBytes/numChunks/sizeof(uint16_t);
+
+                    std::vector<uint32_t> sizes(numChunks);
+
+                    // Canonical codes and tANS fail for chunks with too many different symbols
+                    bool ok = true;
+
+                    tile.huffman.clear();
+                    for (uint32_t k=0; k<numChunks && ok; k++)
+                    {
+                        const uint16_t *chunk  = reinterpret_cast<const uint16_t*>(src)+k*chunkSize;
+                        const size_t    before = tile.huffman.size();
+
+                        switch (comp.getProc(j))
+                        {
+                        case FITS::kFactHuffman16Canonical:
+                            ok = Huffman::EncodeCanonical(tile.huffman, chunk, chunkSize, tile.encoder);
+                            break;
+                        case FITS::kFactTANS16:
+                            ok = TANS::Encode(tile.huffman, chunk, chunkSize, tile.ansEncoder);
+                            break;
+                        default:
+                            Huffman::Encode(tile.huffman, chunk, chunkSize, tile.encoder);
+                            break;
+                        }
+
+                        sizes[k] = tile.huffman.size()-before;
+                    }
+
+                    const size_t total = numChunks*sizeof(uint32_t) + tile.huffman.size();
+
+                    // Not worth it: store the data as it is
+                    if (!ok || total>=numBytes)
+                    {
+                        comp.sequence[j] = FITS::kFactRaw;
+                        tile.compressed.insert(tile.compressed.end(), src, src+numBytes);
+                        break;
+                    }
+
+                    const char *ptr = reinterpret_cast<const char*>(sizes.data());
+                    tile.compressed.insert(tile.compressed.end(), ptr, ptr+numChunks*sizeof(uint32_t));
+                    tile.compressed.insert(tile.compressed.end(), tile.huffman.begin(), tile.huffman.end());
+                }
+                break;
+
+            default:
+                tile.compressed.insert(tile.compressed.end(), src, src+numBytes);
+                break;
+            }
+        }
+
+        comp.SetBlockSize(tile.compressed.size()-start);
+        comp.Memcpy(tile.compressed.data()+start);
+    }
+
+    // Transpose the rows column by column and compress the columns
+    void CompressTile(Tile &tile)
+    {
+        const uint32_t numRows = tile.numRows;
+
+        tile.rawsum.reset();
+        tile.rawsum.addAt(tile.rows.data(), numRows*fBytesPerRow, tile.firstRow*fBytesPerRow);
+
+        tile.transposed.resize(numRows*fBytesPerRow);
+
+        char *dest = tile.transposed.data();
+        for (auto it=fColumns.cbegin(); it!=fColumns.cend(); it++)
+        {
+            const char *src = tile.rows.data()+it->offset;
+
+            if (it->comp.getOrdering()==FITS::kOrderByRow)
+            {
+                for (uint32_t r=0; r<numRows; r++, dest+=it->num*it->size)
+                    memcpy(dest, src+r*fBytesPerRow, it->num*it->size);
+            }
+            else
+            {
+                for (uint32_t e=0; e<it->num; e++)
+                    for (uint32_t r=0; r<numRows; r++, dest+=it->size)
+                        memcpy(dest, src+r*fBytesPerRow+e*it->size, it->size);
+            }
+        }
+
+        tile.compressed.resize(sizeof(FITS::TileHeader));
+        tile.catalog.assign(fColumns.size(), std::make_pair(int64_t(0), int64_t(0)));
+
+        char *src = tile.transposed.data();
+        for (size_t i=0; i<fColumns.size(); i++)
+        {
+            const Column &col = fColumns[i];
+            if (col.num==0)
+                continue;
+
+            const size_t start = tile.compressed.size();
+
+            CompressColumn(tile, src, col);
+
+            tile.catalog[i] = std::make_pair(int64_t(tile.compressed.size()-start), int64_t(start));
+
+            src += size_t(col.num)*col.size*numRows;
+        }
+
+        const FITS::TileHeader head(numRows, tile.compressed.size());
+        memcpy(tile.compressed.data(), &head, sizeof(FITS::TileHeader));
+    }
+
+    // Append a compressed tile to the heap
+    void WriteTile(Tile &tile)
+    {
+        if (tile.ready.valid())
+            tile.ready.get();
+
+        const size_t size = tile.compressed.size();
+
+        fDatasum.addAt(tile.compressed.data(), size, fHeapStart-fDataStart+fHeapSize);
+
+        write(tile.compressed.data(), size);
+        if (!good())
+            Error("Writing tile failed.");
+
+        CatalogRow row(tile.catalog);
+        for (auto it=row.begin(); it!=row.end(); it++)
+            if (it->first>0)
+                it->second += fHeapSize;
+
+        fCatalog.push_back(row);
+
+        fRawsum   += tile.rawsum;
+        fHeapSize += size;
+        fNumRows  += tile.numRows;
+    }
+
+    // Write the compressed tiles at the front of the queue. Wait for
+    // them only if all is true or too many tiles are in flight.
+    void WriteQueue(bool all)
+    {
+        while (!fQueue.empty())
+        {
+            Tile &tile = *fQueue.front();
+
+            const bool wait = all || fQueue.size()>fQueueDepth;
+            if (!wait && tile.ready.valid() && tile.ready.wait_for(std::chrono::seconds(0))!=std::future_status::ready)
+                break;
+
+            try
+            {
+                WriteTile(tile);
+            }
+            catch (...)
+            {
+                // Workers still reference the queued tiles
+                for (auto it=fQueue.begin(); it!=fQueue.end(); it++)
+                    if ((*it)->ready.valid())
+                        (*it)->ready.wait();
+                fQueue.clear();
+
+                clear(rdstate()|std::ios::badbit);
+                throw;
+            }
+
+            fFreeTiles.push_back(std::move(fQueue.front()));
+            fQueue.pop_front();
+        }
+    }
+
+    // Compress the tile being filled, in the background if there are workers
+    void FlushTile()
+    {
+        if (!fTile || fTile->numRows==0)
+            return;
+
+        Tile *ptr = fTile.get();
+
+        if (fThreads.GetNumThreads()>0)
+            ptr->ready = fThreads.Submit([this, ptr]() { CompressTile(*ptr); });
+        else
+            CompressTile(*ptr);
+
+        fQueue.push_back(std::move(fTile));
+
+        WriteQueue(false);
+    }
+
+    // Write the catalog and the final header of the current table
+    void CloseTable()
+    {
+        if (!fTableOpen)
+            return;
+
+        fTableOpen = false;
+
+        FlushTile();
+        WriteQueue(true);
+
+        // More tiles than fit into the catalog: only every shrink-th
+        // tile is cataloged, the others are found from their headers
+        const uint32_t shrink      = fCatalog.size()>fMaxCatalogRows ? (fCatalog.size()+fMaxCatalogRows-1)/fMaxCatalogRows : 1;
+        const uint32_t catalogRows = (fCatalog.size()+shrink-1)/shrink;
+
+        std::vector<char> catalog(size_t(catalogRows)*fColumns.size()*2*sizeof(int64_t));
+
+        char *ptr = catalog.data();
+        for (uint32_t i=0; i<catalogRows; i++)
+            for (auto it=fCatalog[i*shrink].cbegin(); it!=fCatalog[i*shrink].cend(); it++)
+            {
+                const int64_t values[2] = { it->first, it->second };
+
+                // big endian
+                for (int k=0; k<2; k++)
+                    for (int b=0; b<8; b++)
+                        *ptr++ = values[k]>>(56-8*b);
+            }
+
+        fDatasum.add(catalog.data(), catalog.size());
+
+        const std::streamoff end = tellp();
+
+        seekp(fDataStart);
+        write(catalog.data(), catalog.size());
+
+        seekp(fTableStart);
+        const std::string header = CompileTableHeader(catalogRows, shrink);
+        write(header.data(), header.size());
+
+        // Pad the data to full blocks
+        seekp(end);
+        const size_t total = end-fDataStart;
+        WriteZeros((total+2879)/2880*2880-total);
+
+        if (!good())
+            Error("Writing table '"+fTableName+"' failed.");
+
+        fCatalog.clear();
+    }
+
+public:
+    // maxCatalogRows is the space reserved for the catalog. If more
+    // tiles are written, the catalog is shrunk (see ZSHRINK).
+    zofits(const std::string &fname="", uint32_t maxCatalogRows=1000, uint32_t numRowsPerTile=100)
+        : fBytesPerRow(0), fNumRowsPerTile(numRowsPerTile), fMaxCatalogRows(maxCatalogRows), fTableOpen(false),
+          fTableStart(0), fDataStart(0), fHeapStart(0), fHeapSize(0), fNumRows(0), fQueueDepth(0)
+    {
+        if (fNumRowsPerTile==0 || fMaxCatalogRows==0)
+            throw std::runtime_error("Number of rows per tile and catalog size must not be zero.");
+
+        if (!fname.empty())
+            open(fname);
+    }
+
+    ~zofits()
+    {
+        try
+        {
+            close();
+        }
+        catch (const std::exception &)
+        {
+        }
+    }
+
+    void open(const std::string &fname)
+    {
+        std::ofstream::open(fname.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+    }
+
+    // Finish the current table and close the file
+    bool close()
+    {
+        if (!is_open())
+            return false;
+
+        try
+        {
+            CloseTable();
+        }
+        catch (...)
+        {
+            std::ofstream::close();
+            throw;
+        }
+
+        std::ofstream::close();
+        return !fail();
+    }
+
+    // Compress the tiles with numThreads workers. Zero compresses on
+    // the caller's thread.
+    void SetNumThreads(size_t numThreads)
+    {
+        WriteQueue(true);
+
+        fThreads.Start(numThreads);
+        fQueueDepth = 2*numThreads;
+    }
+
+    // Add a column to the table written by the next call to
+    // WriteTableHeader. Smoothing and entropy coding are
+    // only supported for 16 bit integers. The last processing must be
+    // kFactRaw or one of the entropy coders kFactHuffman16,
+    // kFactHuffman16Canonical and kFactTANS16, all others kFactSmoothing.
+    void AddColumn(const FITS::Compression &comp, uint32_t cnt, char type, const std::string &name,
+                   const std::string &unit="", const std::string &comment="")
+    {
+        const uint32_t size = FITS::SizeFromType(type);
+        if (size==0 || type=='Q')
+            throw std::runtime_error("Column '"+name+"' has an unsupported type.");
+
+        size_t offset = 0;
+        for (auto it=fNewColumns.cbegin(); it!=fNewColumns.cend(); it++)
+        {
+            if (it->name==name)
+                throw std::runtime_error("Column '"+name+"' already exists.");
+
+            offset += size_t(it->num)*it->size;
+        }
+
+        const uint16_t numProcs = comp.getNumProcs();
+        for (uint16_t j=0; j<numProcs; j++)
+        {
+            const FITS::CompressionProcess_t proc = comp.getProc(j);
+
+            const bool last = j==numProcs-1;
+            if ((last && proc==FITS::kFactSmoothing) || (!last && proc!=FITS::kFactSmoothing) || proc>FITS::kFactTANS16)
+                throw std::runtime_error("Column '"+name+"' has an invalid sequence of processings.");
+
+            if (proc!=FITS::kFactRaw && type!='I')
+                throw std::runtime_error("Column '"+name+"': smoothing and entropy coding need 16 bit integers.");
+        }
+
+        const Column col = { name, unit, comment, type, cnt, size, offset, comp };
+        fNewColumns.push_back(col);
+    }
+
+    // Keys are set for the next table, like the columns are added
+    void SetStr(const std::string &key, const std::string &value, const std::string &comment="")
+    {
+        SetUserKey(key, FormatStr(value), comment);
+    }
+
+    void SetBool(const std::string &key, bool value, const std::string &comment="")
+    {
+        SetUserKey(key, FormatValue(value ? "T" : "F"), comment);
+    }
+
+    void SetInt(const std::string &key, int64_t value, const std::string &comment="")
+    {
+        SetUserKey(key, FormatValue(std::to_string((long long int)value)), comment);
+    }
+
+    void SetFloat(const std::string &key, double value, const std::string &comment="")
+    {
+        std::ostringstream str;
+        str << std::uppercase << std::scientific << std::setprecision(15) << value;
+        SetUserKey(key, FormatValue(str.str()), comment);
+    }
+
+    // Start a new table with the columns added and the keys set since
+    // the last call. A table still open is closed first.
+    void WriteTableHeader(const std::string &name)
+    {
+        CloseTable();
+
+        if (!is_open() || !good())
+            Error("File not open for writing.");
+
+        if (tellp()==0)
+            WritePrimaryHeader();
+
+        fColumns.swap(fNewColumns);
+        fKeys.swap(fNewKeys);
+        fNewColumns.clear();
+        fNewKeys.clear();
+
+        fBytesPerRow = 0;
+        for (auto it=fColumns.cbegin(); it!=fColumns.cend(); it++)
+            fBytesPerRow += size_t(it->num)*it->size;
+
+        fTableName = name;
+        fHeapSize  = 0;
+        fNumRows   = 0;
+        fDatasum.reset();
+        fRawsum.reset();
+
+        fTableStart = tellp();
+
+        const std::string header = CompileTableHeader(fMaxCatalogRows, 1);
+        write(header.data(), header.size());
+
+        fDataStart = tellp();
+        WriteZeros(size_t(fMaxCatalogRows)*fColumns.size()*2*sizeof(int64_t));
+        fHeapStart = tellp();
+
+        if (!good())
+            Error("Writing header of table '"+name+"' failed.");
+
+        fTableOpen = true;
+    }
+
+    // Append a row. cnt must be the number of bytes per row. The
+    // columns are stored in the order they were added, in the
+    // byte order of the machine, as zfits returns them.
+    bool WriteRow(const void *ptr, size_t cnt)
+    {
+        if (!fTableOpen)
+            throw std::runtime_error("WriteRow called without a table header written.");
+
+        if (cnt!=fBytesPerRow)
+        {
+            std::ostringstream str;
+            str << "WriteRow - Size " << cnt << " does not match the expected size of " << fBytesPerRow << " bytes.";
+            throw std::runtime_error(str.str());
+        }
+
+        if (!fTile)
+        {
+            fTile = GetFreeTile();
+            fTile->firstRow = fNumRows + fNumRowsPerTile*(fQueue.size());
+            fTile->numRows  = 0;
+            fTile->rows.resize(size_t(fNumRowsPerTile)*fBytesPerRow);
+        }
+
+        memcpy(fTile->rows.data()+fTile->numRows*fBytesPerRow, ptr, cnt);
+
+        if (++fTile->numRows==fNumRowsPerTile)
+            FlushTile();
+
+        return good();
+    }
+
+    size_t GetNumRows() const { return fNumRows + fNumRowsPerTile*fQueue.size() + (fTile ? fTile->numRows : 0); }
+    size_t GetBytesPerRow() const { return fBytesPerRow; }
+};
+
+#endif